@@ -64,6 +64,11 @@ class KNotesIface : virtual public DCOPObject
 		 */
 		virtual ASYNC hideNote( const QString& noteId ) const = 0;
 
+		/**
+		 * Hide all notes.
+		 */
+		virtual ASYNC hideAllNotes() const = 0;
+
 		/**
 		 * Deletes a note forever.
 		 * @param noteId the id of the note to kill
@@ -0,0 +1,88 @@
+/**
+ * Saving stores in child processes next to the remaining sinks
+ */
+
+#include <qvaluelist.h>
+
+#include "backgroundsave.h"
+#include "prefetch.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+struct PendingSave
+{
+	pid_t pid;
+	BackgroundSave::Writer *writer;
+	OSyncContext *ctx;
+};
+
+static QValueList<PendingSave> pendingSaves;
+
+//--------------------------------------------------------------------------------
+
+void BackgroundSave::start(Writer &writer, OSyncContext *ctx)
+{
+	pid_t pid = Prefetch::forkChild();
+	if (pid < 0) {
+		osync_trace(TRACE_INTERNAL, "no child, saving right away");
+		finish(writer, ctx, writer.write());
+		return;
+	}
+
+	if (pid == 0) {
+		bool ok = writer.write();
+
+		// no destructors or atexit handlers, they belong to the plugin
+		_exit(ok ? 0 : 1);
+	}
+
+	PendingSave save;
+	save.pid = pid;
+	save.writer = &writer;
+	save.ctx = ctx;
+	if (ctx)
+		osync_context_ref(ctx);
+	pendingSaves.append(save);
+	osync_trace(TRACE_INTERNAL, "saving in child %d", pid);
+}
+
+//--------------------------------------------------------------------------------
+
+void BackgroundSave::reap(bool wait)
+{
+	QValueList<PendingSave>::Iterator it = pendingSaves.begin();
+	while (it != pendingSaves.end()) {
+		int status = 0;
+		pid_t done;
+		while ((done = ::waitpid((*it).pid, &status, wait ? 0 : WNOHANG)) < 0 && errno == EINTR)
+			;
+		if (done == 0) {
+			++it;
+			continue;
+		}
+
+		bool ok = (done > 0) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		PendingSave save = *it;
+		it = pendingSaves.remove(it);
+
+		finish(*save.writer, save.ctx, ok);
+		if (save.ctx)
+			osync_context_unref(save.ctx);
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+void BackgroundSave::finish(Writer &writer, OSyncContext *ctx, bool ok)
+{
+	writer.written(ok);
+
+	if (!ctx)
+		return;
+	if (ok)
+		osync_context_report_success(ctx);
+	else
+		osync_context_report_error(ctx, OSYNC_ERROR_IO_ERROR, "Unable to save the changes");
+}
@@ -0,0 +1,41 @@
+#ifndef KDEPIM_OSYNC_BACKGROUNDSAVE_H
+#define KDEPIM_OSYNC_BACKGROUNDSAVE_H
+
+#include <sys/types.h>
+#include <opensync/opensync.h>
+#include <opensync/opensync-context.h>
+
+/* Saves a store in a forked child process, while the plugin goes on with the
+ * remaining sinks. The child works on a copy-on-write snapshot of the loaded
+ * store, so the plugin may drop or change its copy right after start(). Where
+ * the plugin can't be forked, see Prefetch::canFork(), start() saves right away.
+ *
+ * The context of the disconnect which started the save is only reported once
+ * the child wrote the store and made it durable. The last sink to disconnect
+ * waits for all saves, see reap().
+ */
+class BackgroundSave
+{
+	public:
+		class Writer
+		{
+			public:
+				virtual ~Writer() {}
+				/* runs in the child, true once the store is on disk */
+				virtual bool write() = 0;
+				/* runs in the plugin when the child is done */
+				virtual void written(bool ok) = 0;
+		};
+
+		/* save in a child and report ctx once it is done; if no child can be
+		 * started, the writer runs right away */
+		static void start(Writer &writer, OSyncContext *ctx);
+
+		/* report the saves which are done; with wait, block until all are */
+		static void reap(bool wait);
+
+	private:
+		static void finish(Writer &writer, OSyncContext *ctx, bool ok);
+};
+
+#endif // KDEPIM_OSYNC_BACKGROUNDSAVE_H
@@ -0,0 +1,224 @@
+/**
+ * File stamp journal for incremental change detection
+ */
+
+#include <qfile.h>
+#include <qdir.h>
+#include <qfileinfo.h>
+#include <qdatastream.h>
+
+#include "changejournal.h"
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// file systems take their timestamps from a coarser clock
+static const Q_INT64 CLOCK_SLACK = Q_INT64(1000000000);
+
+static const Q_UINT32 JOURNAL_MAGIC = 0x4b4a524e;
+static const Q_UINT32 JOURNAL_VERSION = 1;
+
+//--------------------------------------------------------------------------------
+
+Q_INT64 ChangeJournal::now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return Q_INT64(tv.tv_sec) * 1000000000 + Q_INT64(tv.tv_usec) * 1000;
+}
+
+//--------------------------------------------------------------------------------
+
+ChangeJournal::Stamp ChangeJournal::stampOf(const QString &file)
+{
+	Stamp stamp;
+	struct stat st;
+	if (::stat(QFile::encodeName(file), &st) == 0) {
+		stamp.inode = st.st_ino;
+		stamp.size = st.st_size;
+		stamp.mtime = Q_INT64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+		stamp.ctime = Q_INT64(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+	}
+	return stamp;
+}
+
+//--------------------------------------------------------------------------------
+
+void ChangeJournal::begin(Q_INT64 since)
+{
+	clear();
+	valid = true;
+	this->since = since;
+}
+
+//--------------------------------------------------------------------------------
+
+void ChangeJournal::clear()
+{
+	valid = false;
+	entries.clear();
+	sinkUids.clear();
+}
+
+//--------------------------------------------------------------------------------
+
+void ChangeJournal::record(const QString &file, const QStringList &uids)
+{
+	if (!valid)
+		return;
+
+	Entry entry;
+	entry.stamp = stampOf(file);
+	entry.uids = uids;
+
+	// a change after loading might not be part of what was reported
+	if (entry.stamp.ctime >= since - CLOCK_SLACK || entry.stamp.mtime >= since - CLOCK_SLACK) {
+		valid = false;
+		return;
+	}
+	entries[file] = entry;
+}
+
+//--------------------------------------------------------------------------------
+
+void ChangeJournal::recordPaths(const QStringList &paths)
+{
+	for (QStringList::ConstIterator it = paths.begin(); it != paths.end(); ++it) {
+		record(*it);
+
+		// adding or removing a file changes the directory, editing one does not
+		QFileInfo info(*it);
+		if (info.isDir()) {
+			QDir dir(*it);
+			QStringList files = dir.entryList(QDir::Files | QDir::Hidden);
+			for (QStringList::ConstIterator f = files.begin(); f != files.end(); ++f)
+				record(dir.filePath(*f));
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+void ChangeJournal::write(QDataStream &out) const
+{
+	out << JOURNAL_MAGIC << JOURNAL_VERSION << (Q_UINT32) entries.count();
+	for (QMap<QString, Entry>::ConstIterator it = entries.begin(); it != entries.end(); ++it) {
+		const Entry &entry = it.data();
+		out << it.key() << entry.stamp.inode << entry.stamp.size << entry.stamp.mtime << entry.stamp.ctime << entry.uids;
+	}
+	out << sinkUids;
+}
+
+//--------------------------------------------------------------------------------
+
+bool ChangeJournal::read(QDataStream &in)
+{
+	clear();
+
+	Q_UINT32 magic = 0, version = 0, count = 0;
+	in >> magic >> version;
+	if (magic != JOURNAL_MAGIC || version != JOURNAL_VERSION)
+		return false;
+
+	in >> count;
+	for (Q_UINT32 i = 0; i < count && !in.atEnd(); i++) {
+		QString path;
+		Entry entry;
+		in >> path >> entry.stamp.inode >> entry.stamp.size >> entry.stamp.mtime >> entry.stamp.ctime >> entry.uids;
+		entries[path] = entry;
+	}
+	if (entries.count() != count || in.atEnd()) {
+		entries.clear();
+		return false;
+	}
+	in >> sinkUids;
+
+	valid = true;
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool ChangeJournal::load(const QString &fileName)
+{
+	clear();
+
+	QFile file(fileName);
+	if (!file.open(IO_ReadOnly))
+		return false;
+
+	QDataStream in(&file);
+	valid = read(in) && file.status() == IO_Ok;
+	return valid;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Write the journal to a temporary file which replaces the old one, so that a
+ * crash never leaves a partial journal behind.
+ */
+bool ChangeJournal::save(const QString &fileName) const
+{
+	if (!valid)
+		return false;
+
+	QString tmpName = fileName + ".new";
+	QFile file(tmpName);
+	if (!file.open(IO_WriteOnly | IO_Truncate))
+		return false;
+
+	QDataStream out(&file);
+	write(out);
+
+	file.flush();
+	bool ok = (file.status() == IO_Ok) && (fsync(file.handle()) == 0);
+	file.close();
+
+	if (!ok || ::rename(QFile::encodeName(tmpName), QFile::encodeName(fileName)) != 0) {
+		QFile::remove(tmpName);
+		return false;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool ChangeJournal::unchanged(const QString &file) const
+{
+	QMap<QString, Entry>::ConstIterator it = entries.find(file);
+	return valid && it != entries.end() && it.data().stamp == stampOf(file);
+}
+
+//--------------------------------------------------------------------------------
+
+bool ChangeJournal::allUnchanged() const
+{
+	if (!valid || entries.isEmpty())
+		return false;
+
+	for (QMap<QString, Entry>::ConstIterator it = entries.begin(); it != entries.end(); ++it) {
+		if (!(it.data().stamp == stampOf(it.key())))
+			return false;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+QStringList ChangeJournal::uids(const QString &file) const
+{
+	QMap<QString, Entry>::ConstIterator it = entries.find(file);
+	return (it != entries.end()) ? it.data().uids : QStringList();
+}
+
+//--------------------------------------------------------------------------------
+
+QStringList ChangeJournal::allUids() const
+{
+	QStringList all = sinkUids;
+	for (QMap<QString, Entry>::ConstIterator it = entries.begin(); it != entries.end(); ++it)
+		all += it.data().uids;
+	return all;
+}
@@ -0,0 +1,76 @@
+#ifndef KDEPIM_OSYNC_CHANGEJOURNAL_H
+#define KDEPIM_OSYNC_CHANGEJOURNAL_H
+
+#include <qstring.h>
+#include <qstringlist.h>
+#include <qmap.h>
+
+class QDataStream;
+
+/* Records the files backing a sink, with the uids of the items found in them,
+ * as of the last completed sync.
+ *
+ * A file counts as unchanged while its inode, size, mtime and ctime are the
+ * same. Stamps are only trusted for files which were not touched after the
+ * data was loaded; otherwise the journal becomes invalid and the next sync
+ * enumerates everything again.
+ */
+class ChangeJournal
+{
+	public:
+		ChangeJournal() : valid(false), since(0) {}
+
+		/* current time in nanoseconds, comparable with the file stamps */
+		static Q_INT64 now();
+
+		/* start recording; since is the time before the data was loaded */
+		void begin(Q_INT64 since);
+		void clear();
+		bool isValid() const { return valid; }
+		void invalidate() { valid = false; }
+
+		/* stamp a file, replacing what was recorded for it */
+		void record(const QString &file, const QStringList &uids = QStringList());
+		/* stamp files, and directories together with the files in them */
+		void recordPaths(const QStringList &paths);
+		/* an item which is not attributed to a single file */
+		void addUid(const QString &uid) { sinkUids.append(uid); }
+
+		bool load(const QString &fileName);
+		bool save(const QString &fileName) const;
+		void write(QDataStream &out) const;
+		bool read(QDataStream &in);
+
+		bool unchanged(const QString &file) const;
+		bool allUnchanged() const;
+		QStringList uids(const QString &file) const;
+		QStringList allUids() const;
+
+	private:
+		struct Stamp
+		{
+			Stamp() : inode(-1), size(-1), mtime(-1), ctime(-1) {}
+			bool operator==(const Stamp &other) const
+			{
+				return inode == other.inode && size == other.size &&
+				       mtime == other.mtime && ctime == other.ctime;
+			}
+
+			Q_INT64 inode, size, mtime, ctime;
+		};
+
+		struct Entry
+		{
+			Stamp stamp;
+			QStringList uids;
+		};
+
+		static Stamp stampOf(const QString &file);
+
+		bool valid;
+		Q_INT64 since;
+		QMap<QString, Entry> entries;
+		QStringList sinkUids;
+};
+
+#endif // KDEPIM_OSYNC_CHANGEJOURNAL_H
@@ -0,0 +1,185 @@
+/**
+ * Journal of the changes committed to a store until it is saved
+ */
+
+#include <qfile.h>
+#include <qdir.h>
+#include <qfileinfo.h>
+#include <qdatastream.h>
+
+#include "commitjournal.h"
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+// records are made durable at the latest after this many of them
+static const unsigned int SYNC_BATCH = 256;
+
+//--------------------------------------------------------------------------------
+
+bool CommitJournal::open()
+{
+	if (fd >= 0)
+		return true;
+
+	fd = ::open(QFile::encodeName(path), O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (fd < 0)
+		return false;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	pending = 0;
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+void CommitJournal::close()
+{
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	pending = 0;
+}
+
+//--------------------------------------------------------------------------------
+
+bool CommitJournal::append(OSyncChange *chg)
+{
+	if (path.isEmpty() || !open())
+		return false;
+
+	char *data = 0;
+	unsigned int size = 0;
+	const char *format = "";
+	OSyncData *odata = osync_change_get_data(chg);
+	if (odata) {
+		osync_data_get_data(odata, &data, &size);
+		OSyncObjFormat *objformat = osync_data_get_objformat(odata);
+		if (objformat)
+			format = osync_objformat_get_name(objformat);
+	}
+
+	QByteArray record;
+	QDataStream out(record, IO_WriteOnly);
+	out << (Q_UINT32) 0;  // length, filled in below
+	out << (Q_INT32) osync_change_get_changetype(chg) << QCString(osync_change_get_uid(chg)) << QCString(format);
+	out.writeBytes(data, size);
+
+	Q_UINT32 length = htonl(record.size() - sizeof(Q_UINT32));
+	memcpy(record.data(), &length, sizeof(length));
+
+	// one write, so that a record is either complete or at the end of the file
+	off_t start = ::lseek(fd, 0, SEEK_END);
+	const char *p = record.data();
+	unsigned int left = record.size();
+	while (left > 0) {
+		ssize_t n = ::write(fd, p, left);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			// the next record must not follow a partial one
+			if (start < 0 || ::ftruncate(fd, start) != 0)
+				close();
+			return false;
+		}
+		p += n;
+		left -= n;
+	}
+
+	if (++pending >= SYNC_BATCH)
+		return sync();
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool CommitJournal::sync()
+{
+	if (fd < 0 || pending == 0)
+		return true;
+
+	if (fdatasync(fd) != 0)
+		return false;
+	pending = 0;
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+void CommitJournal::discard()
+{
+	close();
+	if (!path.isEmpty())
+		QFile::remove(path);
+}
+
+//--------------------------------------------------------------------------------
+
+bool CommitJournal::load(QValueList<Record> &records) const
+{
+	records.clear();
+
+	QFile file(path);
+	if (path.isEmpty() || !file.open(IO_ReadOnly))
+		return false;
+
+	QByteArray all = file.readAll();
+	unsigned int pos = 0;
+	while (pos + sizeof(Q_UINT32) <= all.size()) {
+		Q_UINT32 length;
+		memcpy(&length, all.data() + pos, sizeof(length));
+		length = ntohl(length);
+		pos += sizeof(Q_UINT32);
+		if (length > all.size() - pos)
+			break;  // cut short by a crash
+
+		QByteArray block;
+		block.setRawData(all.data() + pos, length);
+		{
+			QDataStream in(block, IO_ReadOnly);
+			Record record;
+			Q_INT32 type;
+			in >> type >> record.uid >> record.format >> record.data;
+			record.type = (OSyncChangeType) type;
+			records.append(record);
+		}
+		block.resetRawData(all.data() + pos, length);
+		pos += length;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool CommitJournal::syncFiles(const QStringList &paths)
+{
+	bool ok = true;
+	for (QStringList::ConstIterator it = paths.begin(); it != paths.end(); ++it) {
+		QStringList files;
+		QFileInfo info(*it);
+		if (info.isDir()) {
+			QDir dir(*it);
+			QStringList entries = dir.entryList(QDir::Files | QDir::Hidden);
+			for (QStringList::ConstIterator f = entries.begin(); f != entries.end(); ++f)
+				files.append(dir.filePath(*f));
+		}
+		// the directory too, for files which were replaced by renaming
+		files.append(info.isDir() ? *it : info.dirPath(true));
+		if (!info.isDir())
+			files.append(*it);
+
+		for (QStringList::ConstIterator f = files.begin(); f != files.end(); ++f) {
+			int fd = ::open(QFile::encodeName(*f), O_RDONLY);
+			if (fd < 0)
+				continue;  // e.g. a file which was removed meanwhile
+			if (fsync(fd) != 0)
+				ok = false;
+			::close(fd);
+		}
+	}
+	return ok;
+}
@@ -0,0 +1,62 @@
+#ifndef KDEPIM_OSYNC_COMMITJOURNAL_H
+#define KDEPIM_OSYNC_COMMITJOURNAL_H
+
+#include <qstring.h>
+#include <qstringlist.h>
+#include <qcstring.h>
+#include <qvaluelist.h>
+#include <opensync/opensync.h>
+#include <opensync/opensync-data.h>
+
+/* Records the changes committed to a store until the store is saved.
+ *
+ * The hashtable learns about a commit long before the store is written, so a
+ * crash in between would leave the hashtable describing items the store never
+ * got. Every applied change is appended to the journal first; the journal is
+ * made durable before the hashtable entries are written, and removed once the
+ * store is saved. A journal found on connect belongs to an interrupted sync and
+ * is replayed into the store.
+ *
+ * Each record is a 32 bit length (network order) followed by QDataStream data:
+ * Q_INT32 change type, QCString uid, QCString objformat, QByteArray data.
+ * A record cut short by a crash is ignored.
+ */
+class CommitJournal
+{
+	public:
+		struct Record
+		{
+			OSyncChangeType type;
+			QCString uid;
+			QCString format;
+			QByteArray data;
+		};
+
+		CommitJournal() : fd(-1), pending(0) {}
+		~CommitJournal() { close(); }
+
+		void setPath(const QString &fileName) { path = fileName; }
+
+		/* record an applied change; it is durable after the next sync() */
+		bool append(OSyncChange *chg);
+		/* make the appended records durable, one fsync for all of them */
+		bool sync();
+		/* the store is saved, the records are not needed any more */
+		void discard();
+
+		/* the records of an interrupted sync, false if there are none */
+		bool load(QValueList<Record> &records) const;
+
+		/* fsync files written by someone else, e.g. a saved resource */
+		static bool syncFiles(const QStringList &paths);
+
+	private:
+		bool open();
+		void close();
+
+		QString path;
+		int fd;
+		unsigned int pending;  // records written since the last sync()
+};
+
+#endif // KDEPIM_OSYNC_COMMITJOURNAL_H
@@ -5,10 +5,28 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <kapplication.h>
 #include <qfile.h>
+#include <qdom.h>
 
 #include "datasource.h"
+#include "synchelper.h"
+#include "prefetch.h"
+#include "backgroundsave.h"
+
+// commits are sampled in batches of this size for the MemoryProfile option
+static const unsigned int COMMIT_PROFILE_BATCH = 100;
+
+// sinks between connect and disconnect; the last one to disconnect waits for
+// the saves which run in the background
+static unsigned int connectedSinks = 0;
+
+// ranks of the held back changes, see OSyncDataSource::rank_of_date()
+static const int PAST_RANK = 100000;
+static const int NO_DATE_RANK = 2 * PAST_RANK;
 
 extern "C"
 {
@@ -17,7 +35,10 @@ static void connect_wrapper(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSync
 {
   osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __PRETTY_FUNCTION__, sink, userdata, info, ctx);
   OSyncDataSource *obj = static_cast<OSyncDataSource *>(userdata);
+  obj->memProfile().begin();
+  connectedSinks++;
   obj->connect(sink, info, ctx);
+  obj->memProfile().mark("connect");
   osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
 }
 
@@ -27,7 +48,21 @@ static void disconnect_wrapper(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OS
 {
   osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __PRETTY_FUNCTION__, sink, userdata, info, ctx);
   OSyncDataSource *obj = static_cast<OSyncDataSource *>(userdata);
+
+  // left over if the sync failed before sync_done
+  OSyncError *error = NULL;
+  if (!obj->flush_hash_updates(sink, &error)) {
+    osync_trace(TRACE_INTERNAL, "unable to update the hashtable: %s", osync_error_print(&error));
+    osync_error_unref(&error);
+  }
+
   obj->disconnect(sink, info, ctx);
+  obj->memProfile().mark("disconnect");
+  obj->memProfile().report();
+
+  if (connectedSinks > 0)
+    connectedSinks--;
+  BackgroundSave::reap(connectedSinks == 0);
   osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
 }
 
@@ -38,7 +73,9 @@ static void get_changes_wrapper(OSyncObjTypeSink *sink, OSyncPluginInfo *info,
 {
   osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __PRETTY_FUNCTION__, sink, userdata, info, ctx);
   OSyncDataSource *obj = static_cast<OSyncDataSource *>(userdata);
+  obj->begin_changes(sink, slow_sync);
   obj->get_changes(sink, info, ctx, slow_sync);
+  obj->memProfile().mark("get_changes");
   osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
 }
 
@@ -50,6 +87,18 @@ static void commit_wrapper(OSyncObjTypeSink *sink, OSyncPluginInfo *info,
   osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p, %p)", __PRETTY_FUNCTION__, sink, userdata, info, ctx, chg);
   OSyncDataSource *obj = static_cast<OSyncDataSource *>(userdata);
   obj->commit(sink, info, ctx, chg);
+  obj->memProfile().markEvery("commit", COMMIT_PROFILE_BATCH);
+  osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
+}
+
+//--------------------------------------------------------------------------------
+
+static void committed_all_wrapper(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+  osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __PRETTY_FUNCTION__, sink, userdata, info, ctx);
+  OSyncDataSource *obj = static_cast<OSyncDataSource *>(userdata);
+  obj->committed_all(sink, info, ctx);
+  obj->memProfile().mark("committed_all");
   osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
 }
 
@@ -60,6 +109,7 @@ static void sync_done_wrapper(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSy
   osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __PRETTY_FUNCTION__, sink, userdata, info, ctx);
   OSyncDataSource *obj = static_cast<OSyncDataSource *>(userdata);
   obj->sync_done(sink, info, ctx);
+  obj->memProfile().mark("sync_done");
   osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
 }
 
@@ -85,6 +135,7 @@ bool OSyncDataSource::initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSy
   osync_objtype_sink_set_disconnect_func(sink, disconnect_wrapper);
   osync_objtype_sink_set_get_changes_func(sink, get_changes_wrapper);
   osync_objtype_sink_set_commit_func(sink, commit_wrapper);
+  osync_objtype_sink_set_committed_all_func(sink, committed_all_wrapper);
   osync_objtype_sink_set_sync_done_func(sink, sync_done_wrapper);
 
   osync_objtype_sink_set_userdata(sink, this);
@@ -95,22 +146,33 @@ bool OSyncDataSource::initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSy
   // Request a hashtable from the framework
   osync_objtype_sink_enable_hashtable(sink, TRUE);
 
-  // NOTE: advanced options are per plugin; currently we read the FilterCategory
-  // for each Resource (later this could be separated by Resource via a different name, etc.)
-  // read advanced options
-  OSyncPluginConfig *config = osync_plugin_info_get_config(info);
-  if ( config )
-  {
-    OSyncList *entry = osync_plugin_config_get_advancedoptions(config);
-    for (; entry; entry = entry->next)
-    {
-      OSyncPluginAdvancedOption *option = static_cast<OSyncPluginAdvancedOption*>(entry->data);
+  useHelper = get_advanced_option_bool(info, "SyncHelper");
+  budget.setup(get_advanced_option_uint(info, "MaxChanges"), get_advanced_option_uint(info, "TimeBudget"));
 
-      if ( strcmp(osync_plugin_advancedoption_get_name(option), "FilterCategory") == 0 )
-        categories.append(QString::fromUtf8(osync_plugin_advancedoption_get_value(option)));
-    }
+  commits.setPath(QFile::decodeName(osync_plugin_info_get_configdir(info)) + "/" + objtype + "_commits");
+  replayPending = true;
+
+  if ( get_advanced_option_bool(info, "MemoryProfile") )
+    profile.enable(objtype, QFile::decodeName(osync_plugin_info_get_configdir(info)) + "/" + objtype + "_memprofile");
+
+  const char *peerCapabilities = get_advanced_option(info, "PeerCapabilities");
+  if ( peerCapabilities && *peerCapabilities )
+    load_peer_capabilities(QFile::decodeName(peerCapabilities));
+
+  if ( useHelper && prunes() )
+  {
+    // the helper serves all fields
+    osync_trace(TRACE_INTERNAL, "not using the sync helper for %s, fields are pruned", objtype);
+    useHelper = false;
   }
 
+  // NOTE: advanced options are per plugin; currently we read the FilterCategory
+  // for each Resource (later this could be separated by Resource via a different name, etc.)
+  // an empty value is no filter
+  const char *filterCategory = get_advanced_option(info, "FilterCategory");
+  if ( filterCategory && *filterCategory )
+    categories.append(QString::fromUtf8(filterCategory));
+
   osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
   return true;
 }
@@ -125,6 +187,8 @@ void OSyncDataSource::connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSy
   OSyncError *error = NULL;
   osync_bool statematch = FALSE;
 
+  hashCache.clear();
+
   OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(sink);
 
   if ( !osync_sink_state_equal(state_db, "done", "true", &statematch, &error) )
@@ -135,6 +199,11 @@ void OSyncDataSource::connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSy
     return;
   }
 
+  // if the journal can not be replayed, only a full comparison brings the
+  // store and the hashtable in line again
+  if ( !replay_commits(sink, info) )
+    statematch = FALSE;
+
   if ( !statematch )
   {
     osync_trace(TRACE_INTERNAL, "Setting slow-sync for %s", objtype);
@@ -154,6 +223,18 @@ void OSyncDataSource::sync_done(OSyncObjTypeSink *sink, OSyncPluginInfo *info, O
   // Detection mechanismn if this is the first sync
   OSyncError *error = NULL;
 
+  // the journal is only valid for the state after a completed sync
+  if ( journal.isValid() && !journal.save(journal_path(info)) )
+    osync_trace(TRACE_INTERNAL, "Unable to save the %s journal", objtype);
+
+  if ( !flush_hash_updates(sink, &error) )
+  {
+    osync_context_report_osyncerror(ctx, error);
+    osync_trace(TRACE_EXIT_ERROR, "%s: %s", __PRETTY_FUNCTION__, osync_error_print(&error));
+    osync_error_unref(&error);
+    return;
+  }
+
   OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(sink);
 
   if ( !osync_sink_state_set(state_db, "done", "true", &error) )
@@ -170,12 +251,251 @@ void OSyncDataSource::sync_done(OSyncObjTypeSink *sink, OSyncPluginInfo *info, O
 
 //--------------------------------------------------------------------------------
 
+void OSyncDataSource::committed_all(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx)
+{
+  osync_trace(TRACE_ENTRY, "%s(%p, %p)", __PRETTY_FUNCTION__, info, ctx);
+
+  OSyncError *error = NULL;
+  if ( !flush_hash_updates(sink, &error) )
+  {
+    osync_context_report_osyncerror(ctx, error);
+    osync_trace(TRACE_EXIT_ERROR, "%s: %s", __PRETTY_FUNCTION__, osync_error_print(&error));
+    osync_error_unref(&error);
+    return;
+  }
+  osync_context_report_success(ctx);
+
+  osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
+}
+
+//--------------------------------------------------------------------------------
+
+void OSyncDataSource::begin_changes(OSyncObjTypeSink *sink, osync_bool slow_sync)
+{
+  // the hashtable is rebuilt from scratch, the sync is only done once it completed
+  if ( slow_sync )
+    request_slow_sync(sink);
+
+  if ( budget.begin(slow_sync) )
+    osync_trace(TRACE_INTERNAL, "%s changes are reported within the budget", objtype);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Remember the hashtable entry of an added, modified or deleted item, to be
+ * written with the others by flush_hash_updates(). Only uid, hash and change
+ * type are kept, not the data.
+ */
+void OSyncDataSource::defer_hash_update(OSyncChange *change)
+{
+  HashUpdate update;
+  update.uid = osync_change_get_uid(change);
+  update.hash = osync_change_get_hash(change);
+  update.type = osync_change_get_changetype(change);
+  hashUpdates.append(update);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Write the deferred hashtable entries, one after the other in one go.
+ * The commits they describe are made durable in the commit journal first.
+ */
+bool OSyncDataSource::flush_hash_updates(OSyncObjTypeSink *sink, OSyncError **error)
+{
+  if ( !commits.sync() )
+  {
+    osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to write the commit journal of %s", objtype);
+    return false;
+  }
+
+  if ( echoes.isChanged() && !echoes.save(osync_objtype_sink_get_state_db(sink), error) )
+    return false;
+
+  if ( hashUpdates.isEmpty() )
+    return true;
+
+  OSyncChange *change = osync_change_new(error);
+  if ( !change )
+    return false;
+
+  osync_trace(TRACE_INTERNAL, "writing %d %s hashtable entries", hashUpdates.count(), objtype);
+
+  OSyncHashTable *hashtable = osync_objtype_sink_get_hashtable(sink);
+  for (QValueList<HashUpdate>::ConstIterator it = hashUpdates.begin(); it != hashUpdates.end(); ++it)
+  {
+    osync_change_set_uid(change, (*it).uid);
+    osync_change_set_hash(change, (*it).hash);
+    osync_change_set_changetype(change, (*it).type);
+    osync_hashtable_update_change(hashtable, change);
+  }
+  osync_change_unref(change);
+
+  hashUpdates.clear();
+  return true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool OSyncDataSource::apply_change(OSyncContext *, OSyncChange *)
+{
+  return false;
+}
+
+//--------------------------------------------------------------------------------
+
+bool OSyncDataSource::save_store(OSyncContext *)
+{
+  return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Apply the commits of an interrupted sync to the store again and save it.
+ * Applying a change twice gives the same result, so it does not matter how
+ * much of them reached the store before. Returns false if the store could not
+ * be brought up to date.
+ */
+bool OSyncDataSource::replay_commits(OSyncObjTypeSink *sink, OSyncPluginInfo *info)
+{
+  replayPending = false;
+
+  QValueList<CommitJournal::Record> records;
+  if ( !commits.load(records) )
+    return true;
+
+  osync_trace(TRACE_ENTRY, "%s: %d %s commits", __PRETTY_FUNCTION__, records.count(), objtype);
+
+  OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
+  OSyncError *error = NULL;
+  bool ok = true, applied = true;
+
+  for (QValueList<CommitJournal::Record>::ConstIterator it = records.begin(); ok && it != records.end(); ++it)
+  {
+    const CommitJournal::Record &record = *it;
+
+    OSyncChange *chg = osync_change_new(&error);
+    if ( !chg )
+    {
+      ok = false;
+      break;
+    }
+    osync_change_set_uid(chg, record.uid);
+    osync_change_set_changetype(chg, record.type);
+
+    OSyncObjFormat *objformat = osync_format_env_find_objformat(formatenv, record.format);
+    if ( objformat )
+    {
+      char *data = static_cast<char *>(malloc(record.data.size() + 1));
+      memcpy(data, record.data.data(), record.data.size());
+      data[record.data.size()] = 0;
+
+      OSyncData *odata = osync_data_new(data, record.data.size(), objformat, &error);
+      if ( !odata )
+      {
+        osync_change_unref(chg);
+        ok = false;
+        break;
+      }
+      osync_data_set_objtype(odata, objtype);
+      osync_change_set_data(chg, odata);
+      osync_data_unref(odata);
+    }
+
+    // the others are still applied, so that as little as possible is lost
+    if ( apply_change(0, chg) )
+      defer_hash_update(chg);
+    else
+      applied = false;
+    osync_change_unref(chg);
+  }
+
+  if ( ok && save_store(0) )
+    ok = flush_hash_updates(sink, &error) && applied;
+  else
+  {
+    hashUpdates.clear();
+    ok = false;
+  }
+
+  if ( error )
+  {
+    osync_trace(TRACE_INTERNAL, "%s", osync_error_print(&error));
+    osync_error_unref(&error);
+  }
+
+  // done with it either way; if it failed, a slow-sync takes over
+  commits.discard();
+
+  osync_trace(ok ? TRACE_EXIT : TRACE_EXIT_ERROR, "%s: %s", __PRETTY_FUNCTION__, ok ? "replayed" : "failed");
+  return ok;
+}
+
+//--------------------------------------------------------------------------------
+
+void OSyncDataSource::request_slow_sync(OSyncObjTypeSink *sink)
+{
+  osync_trace(TRACE_INTERNAL, "%s is not in sync until sync_done", objtype);
+
+  OSyncError *error = NULL;
+  if ( !osync_sink_state_set(osync_objtype_sink_get_state_db(sink), "done", "false", &error) )
+  {
+    osync_trace(TRACE_INTERNAL, "Unable to reset the %s state: %s", objtype, osync_error_print(&error));
+    osync_error_unref(&error);
+  }
+}
+
+//--------------------------------------------------------------------------------
+
 bool OSyncDataSource::report_change(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx,
                                     QString uid, QString data, QString hash, OSyncObjFormat *objformat)
+{
+  QCString utf8 = data.utf8();
+  return report_change(sink, info, ctx, uid, utf8.data(), utf8.length(), hash, objformat);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Report an item whose data is already available as (not necessarily 0-terminated)
+ * UTF-8 bytes, e.g. a card taken verbatim from a vcf file.
+ */
+bool OSyncDataSource::report_change(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx,
+                                    QString uid, const char *data, unsigned int size, QString hash,
+                                    OSyncObjFormat *objformat)
 {
   osync_trace(TRACE_ENTRY, "%s(%p, %p, %s, (data), (hash), %p)", __PRETTY_FUNCTION__,
                     info, ctx, static_cast<const char*>(uid.utf8()), objformat);
 
+  QCString uid_utf8 = uid.utf8();
+  QCString hash_utf8 = hash.utf8();
+
+  OSyncHashTable *hashtable = osync_objtype_sink_get_hashtable(sink);
+  if ( !hashCache.isLoaded() )
+    hashCache.load(hashtable);
+
+  // an unchanged item is only marked alive, so that it is not taken as deleted;
+  // nothing is written to the hashtable for it
+  const char *known = hashCache.mark(uid_utf8);
+  if ( known && qstrcmp(known, hash_utf8) == 0 )
+  {
+    osync_trace(TRACE_EXIT, "%s: unchanged", __PRETTY_FUNCTION__);
+    return true;
+  }
+
+  // an item committed in the last sync, read back with another hash
+  if ( !echoes.isLoaded() )
+    echoes.load(osync_objtype_sink_get_state_db(sink));
+  if ( known && data && echoes.contains(uid_utf8) && echoes.isEcho(uid_utf8, content_fingerprint(data, size)) )
+  {
+    HashUpdate update;
+    update.uid = uid_utf8;
+    update.hash = hash_utf8;
+    update.type = OSYNC_CHANGE_TYPE_MODIFIED;
+    hashUpdates.append(update);
+
+    osync_trace(TRACE_EXIT, "%s: echo of a commit", __PRETTY_FUNCTION__);
+    return true;
+  }
+
   OSyncError *error = NULL;
 
   OSyncChange *change = osync_change_new(&error);
@@ -187,43 +507,403 @@ bool OSyncDataSource::report_change(OSyncObjTypeSink *sink, OSyncPluginInfo *inf
     return false;
   }
 
-  // Use the hash table to check if the object needs to be reported
-  osync_change_set_uid(change, uid.utf8());
-  osync_change_set_hash(change, hash.utf8());
+  osync_change_set_uid(change, uid_utf8);
+  osync_change_set_hash(change, hash_utf8);
 
-  OSyncHashTable *hashtable = osync_objtype_sink_get_hashtable(sink);
-  OSyncChangeType changetype = osync_hashtable_get_changetype(hashtable, change);
+  OSyncChangeType changetype;
+  if ( known )
+    changetype = OSYNC_CHANGE_TYPE_MODIFIED;
+  else
+    changetype = osync_hashtable_get_changetype(hashtable, change);  // added, or committed meanwhile
   osync_change_set_changetype(change, changetype);
 
-  // Update change in hashtable ... otherwise it gets deleted!
-  osync_hashtable_update_change(hashtable, change);
+  // a modification is never held back: the engine could not see a conflict
+  // with a change of the peer to the same item then
+  if ( budget.isActive() && changetype == OSYNC_CHANGE_TYPE_MODIFIED )
+    budget.spend();
 
-  if ( changetype != OSYNC_CHANGE_TYPE_UNMODIFIED )
+  // reported by rank once all items are seen
+  if ( budget.isActive() && changetype == OSYNC_CHANGE_TYPE_ADDED )
   {
-    char *data_str = strdup((const char *)data.utf8());
+    SyncBudget::Item item;
+    item.uid = uid_utf8;
+    item.hash = hash_utf8;
+    item.type = changetype;
+    item.data.duplicate(data, size);
+    item.objformat = objformat;
+    item.rank = change_rank(data, size);
+    budget.hold(item);
 
-    osync_trace(TRACE_SENSITIVE,"Data:\n%s", data_str);
+    osync_change_unref(change);
+    osync_trace(TRACE_EXIT, "%s: held back", __PRETTY_FUNCTION__);
+    return true;
+  }
 
-    OSyncData *odata = osync_data_new(data_str, strlen(data_str), objformat, &error);
-    if (!odata)
+  bool ok = deliver_change(ctx, change, data, size, objformat);
+  osync_change_unref(change);
+
+  osync_trace(ok ? TRACE_EXIT : TRACE_EXIT_ERROR, "%s", __PRETTY_FUNCTION__);
+  return ok;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Report a change with its data, unless it is unmodified, and remember its
+ * hashtable entry. Returns false after reporting the error to ctx.
+ */
+bool OSyncDataSource::deliver_change(OSyncContext *ctx, OSyncChange *change, const char *data, unsigned int size,
+                                     OSyncObjFormat *objformat)
+{
+  // written with the other changes at the end of get_changes
+  defer_hash_update(change);
+
+  if ( osync_change_get_changetype(change) == OSYNC_CHANGE_TYPE_UNMODIFIED )
+    return true;
+
+  OSyncError *error = NULL;
+  OSyncData *odata = make_data(data, size, objformat, &error);
+  if (!odata)
+  {
+    osync_context_report_osyncerror(ctx, error);
+    osync_trace(TRACE_INTERNAL, "%s", osync_error_print(&error));
+    osync_error_unref(&error);
+    return false;
+  }
+
+  osync_data_set_objtype(odata, objtype);
+
+  osync_change_set_data(change, odata);
+  osync_data_unref(odata);
+
+  osync_context_report_change(ctx, change);
+  return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Report the changes held back by the budget, the lowest rank first, as long
+ * as the budget allows. The others are left for a later sync: they get no
+ * hashtable entry, and the change journal of this sync is not trusted.
+ */
+bool OSyncDataSource::report_held_back(OSyncContext *ctx)
+{
+  if ( !budget.isActive() )
+    return true;
+
+  QValueList<SyncBudget::Item> items = budget.take();
+  unsigned int reported = 0;
+
+  OSyncError *error = NULL;
+  for (QValueList<SyncBudget::Item>::ConstIterator it = items.begin(); it != items.end(); ++it)
+  {
+    if ( !budget.allows(reported) )
+      break;
+
+    const SyncBudget::Item &item = *it;
+    OSyncChange *change = osync_change_new(&error);
+    if ( !change )
     {
       osync_context_report_osyncerror(ctx, error);
-      osync_trace(TRACE_EXIT_ERROR, "%s: %s", __PRETTY_FUNCTION__, osync_error_print(&error));
+      osync_trace(TRACE_INTERNAL, "%s", osync_error_print(&error));
       osync_error_unref(&error);
-      osync_change_unref(change);
       return false;
     }
 
-    osync_data_set_objtype(odata, objtype);
-
-    osync_change_set_data(change, odata);
-    osync_data_unref(odata);
+    osync_change_set_uid(change, item.uid);
+    osync_change_set_hash(change, item.hash);
+    osync_change_set_changetype(change, item.type);
 
-    osync_context_report_change(ctx, change);
+    bool ok = deliver_change(ctx, change, item.data.data(), item.data.size(), item.objformat);
     osync_change_unref(change);
+    if ( !ok )
+      return false;
+    reported++;
   }
 
-  osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
+  if ( reported < items.count() )
+  {
+    osync_trace(TRACE_INTERNAL, "%d of %d %s changes left for the next sync",
+                items.count() - reported, items.count(), objtype);
+    journal.invalidate();
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------------------
+
+QString OSyncDataSource::content_fingerprint(const char *data, unsigned int size) const
+{
+  return fingerprint(data, size);
+}
+
+//--------------------------------------------------------------------------------
+
+void OSyncDataSource::record_echo(const QCString &uid, const QCString &data)
+{
+  echoes.record(uid, content_fingerprint(data.data(), data.length()));
+}
+
+//--------------------------------------------------------------------------------
+
+/** Wrap the bytes of a reported item into the data of its change */
+OSyncData *OSyncDataSource::make_data(const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error)
+{
+  char *data_str = static_cast<char *>(malloc(size + 1));
+  memcpy(data_str, data, size);
+  data_str[size] = 0;
+
+  osync_trace(TRACE_SENSITIVE,"Data:\n%s", data_str);
+
+  OSyncData *odata = osync_data_new(data_str, size, objformat, error);
+  if ( !odata )
+    free(data_str);
+  return odata;
+}
+
+//--------------------------------------------------------------------------------
+
+/** The format to report the changes in. The items which make_data() can't give
+ * in the xmlformat are reported in the text format, which is kept in textFormat.
+ */
+OSyncObjFormat *OSyncDataSource::report_format(OSyncPluginInfo *info, const char *xmlformat, const char *text)
+{
+  OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
+  textFormat = osync_format_env_find_objformat(formatenv, text);
+
+  OSyncObjFormat *objformat = 0;
+  if ( resource_has_format(info, xmlformat) )
+    objformat = osync_format_env_find_objformat(formatenv, xmlformat);
+  return objformat ? objformat : textFormat;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Convert the data of a received change to format in place, with the
+ * converters of the framework and the given converter config. A change which
+ * comes as xmlformat is turned into text this way, so that apply_change() and
+ * the commit journal only deal with the text format. Returns false after
+ * reporting the error to ctx.
+ */
+bool OSyncDataSource::convert_received(OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *chg,
+                                       const char *format, const char *config)
+{
+  if ( osync_change_get_changetype(chg) == OSYNC_CHANGE_TYPE_DELETED )
+    return true;
+
+  OSyncData *odata = osync_change_get_data(chg);
+  OSyncObjFormat *source = odata ? osync_data_get_objformat(odata) : 0;
+  if ( !source || strcmp(osync_objformat_get_name(source), format) == 0 )
+    return true;
+
+  OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
+  OSyncObjFormat *target = osync_format_env_find_objformat(formatenv, format);
+  OSyncError *error = NULL;
+  OSyncFormatConverterPath *path = target ? osync_format_env_find_path(formatenv, source, target, &error) : 0;
+  if ( path )
+  {
+    if ( config )
+      osync_converter_path_set_config(path, config);
+    bool ok = osync_format_env_convert(formatenv, path, odata, &error);
+    osync_converter_path_unref(path);
+    if ( ok )
+      return true;
+  }
+
+  if ( error )
+  {
+    osync_context_report_osyncerror(ctx, error);
+    osync_trace(TRACE_INTERNAL, "%s", osync_error_print(&error));
+    osync_error_unref(&error);
+  }
+  else
+    osync_context_report_error(ctx, OSYNC_ERROR_CONVERT, "Unable to convert the change to %s", format);
+  return false;
+}
+
+//--------------------------------------------------------------------------------
+
+bool OSyncDataSource::resource_has_format(OSyncPluginInfo *info, const char *format) const
+{
+  OSyncPluginConfig *config = osync_plugin_info_get_config(info);
+  OSyncPluginResource *resource = config ? osync_plugin_config_find_active_resource(config, objtype) : 0;
+  if ( !resource )
+    return false;
+
+  OSyncList *entry = osync_plugin_resource_get_objformat_sinks(resource);
+  for (; entry; entry = entry->next)
+  {
+    OSyncObjFormatSink *formatSink = static_cast<OSyncObjFormatSink*>(entry->data);
+    if ( strcmp(osync_objformat_sink_get_objformat(formatSink), format) == 0 )
+      return true;
+  }
+  return false;
+}
+
+//--------------------------------------------------------------------------------
+
+/** The hash of uid as of the start of get_changes, or 0 if it is not known.
+ * The hashtable is read into the cache on first use, after a slow-sync reset.
+ */
+const char *OSyncDataSource::known_hash(OSyncObjTypeSink *sink, const QCString &uid)
+{
+  if ( !hashCache.isLoaded() )
+    hashCache.load(osync_objtype_sink_get_hashtable(sink));
+  return uid.isEmpty() ? 0 : hashCache.find(uid);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Read the fields of objtype from a capabilities file of the peer, in the format
+ * of kdepim-sync-capabilities.xml. Fields the peer can not store are then left out
+ * when serializing, instead of being stripped by the framework afterwards.
+ */
+void OSyncDataSource::load_peer_capabilities(const QString &fileName)
+{
+  QFile file(fileName);
+  QDomDocument doc;
+  if ( !file.open(IO_ReadOnly) || !doc.setContent(&file) )
+  {
+    osync_trace(TRACE_INTERNAL, "Unable to read peer capabilities %s", (const char *)QFile::encodeName(fileName));
+    return;
+  }
+
+  QDomElement caps = doc.documentElement().namedItem(objtype).toElement();
+  for (QDomNode n = caps.firstChild(); !n.isNull(); n = n.nextSibling())
+  {
+    if ( n.isElement() )
+      peerFields.append(n.nodeName());
+  }
+  osync_trace(TRACE_INTERNAL, "peer supports %d fields of %s", peerFields.count(), objtype);
+}
+
+//--------------------------------------------------------------------------------
+
+bool OSyncDataSource::peer_supports(const char *field) const
+{
+  return peerFields.isEmpty() || peerFields.contains(QString::fromLatin1(field));
+}
+
+//--------------------------------------------------------------------------------
+
+/** Get the items from the kdepim-sync-helper when it is enabled.
+ * done is set when the helper delivered all items; otherwise the caller has to
+ * enumerate them itself. Returns false when the helper failed in the middle of
+ * delivering, as some items might already be reported then.
+ */
+bool OSyncDataSource::get_helper_items(ItemVisitor &visitor, bool &done)
+{
+  done = false;
+  if (!useHelper)
+    return true;
+
+  switch (SyncHelper::fetch(objtype, categories, visitor)) {
+    case SyncHelper::Done:
+      done = true;
+      return true;
+
+    case SyncHelper::Failed:
+      return false;
+
+    case SyncHelper::Unavailable:
+      // keep it warm for the next sync, this one is done locally
+      osync_trace(TRACE_INTERNAL, "sync helper not available, starting it");
+      SyncHelper::start();
+      return true;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Whether the items should be enumerated in a prefetch child from connect on.
+ * Not if the sync helper serves them, if the journal shows that nothing changed,
+ * or if the plugin can't be forked.
+ */
+bool OSyncDataSource::want_prefetch(OSyncPluginInfo *info) const
+{
+  if (useHelper || !Prefetch::canFork())
+    return false;
+
+  ChangeJournal previous;
+  return !(previous.load(journal_path(info)) && previous.allUnchanged());
+}
+
+//--------------------------------------------------------------------------------
+
+/** Get the items enumerated by a prefetch child, together with their journal.
+ * done is set when the child delivered all items; otherwise the caller has to
+ * enumerate them itself.
+ */
+bool OSyncDataSource::get_prefetched_items(Prefetch &prefetch, unsigned int part, ItemVisitor &visitor, bool &done)
+{
+  done = false;
+  switch (prefetch.take(part, visitor, journal)) {
+    case SyncHelper::Done:
+      done = true;
+      return true;
+
+    case SyncHelper::Failed:
+      return false;
+
+    case SyncHelper::Unavailable:
+      return true;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** The change journal is kept next to the state DB of the sink.
+ * The hashes depend on the pruned fields, so a journal is only valid for one set of them.
+ */
+QString OSyncDataSource::journal_path(OSyncPluginInfo *info) const
+{
+  QString path = QFile::decodeName(osync_plugin_info_get_configdir(info)) + "/" + objtype + "_journal";
+  if ( prunes() )
+    path += "_" + fingerprint(peerFields.join(",").utf8()).left(8);
+  // the uids depend on the category filter as well
+  if ( !categories.isEmpty() )
+    path += "_" + fingerprint(categories.join("\n").utf8()).left(8);
+  return path;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Load the journal of the last completed sync into previous.
+ * It is removed from disk, so that it is only trusted again once this sync is
+ * completed. Returns false if there is no usable journal.
+ */
+bool OSyncDataSource::take_journal(OSyncPluginInfo *info, osync_bool slow_sync, ChangeJournal &previous)
+{
+  journal.clear();
+
+  QString path = journal_path(info);
+  bool ok = !slow_sync && previous.load(path);
+  QFile::remove(path);
+
+  osync_trace(TRACE_INTERNAL, "%s journal: %s", objtype, ok ? "loaded" : "not available");
+  return ok;
+}
+
+//--------------------------------------------------------------------------------
+
+/** If none of the files changed since the last completed sync, report all items
+ * of the previous journal unchanged and take it over.
+ * Returns false if the items have to be enumerated.
+ */
+bool OSyncDataSource::report_unchanged(const ChangeJournal &previous, ItemVisitor &visitor)
+{
+  if (!previous.allUnchanged())
+    return false;
+
+  QStringList uids = previous.allUids();
+  for (QStringList::ConstIterator it = uids.begin(); it != uids.end(); ++it) {
+    if (!visitor.unchanged(*it))
+      return false;
+  }
+
+  osync_trace(TRACE_INTERNAL, "%s: nothing changed, %d items", objtype, uids.count());
+  journal = previous;
   return true;
 }
 
@@ -235,11 +915,21 @@ bool OSyncDataSource::report_deleted(OSyncObjTypeSink *sink, OSyncPluginInfo *in
 
   OSyncError *error = NULL;
   OSyncHashTable *hashtable = osync_objtype_sink_get_hashtable(sink);
-  OSyncList *u, *uids  = osync_hashtable_get_deleted(hashtable);
   OSyncChange *change = NULL;
 
-  for (u=uids; u; u = u->next) {
-    char *uid = (char *) u->data;
+  if ( !report_held_back(ctx) )
+  {
+    osync_trace(TRACE_EXIT_ERROR, "%s: unable to report the held back changes", __PRETTY_FUNCTION__);
+    return false;
+  }
+
+  // the items which were not marked alive while reporting are gone
+  if ( !hashCache.isLoaded() )
+    hashCache.load(hashtable);
+  QValueList<QCString> uids = hashCache.unmarked();
+
+  for (QValueList<QCString>::ConstIterator u = uids.begin(); u != uids.end(); ++u) {
+    const char *uid = *u;
     osync_trace(TRACE_INTERNAL, "going to delete entry with uid: %s", uid);
   
     change = osync_change_new(&error);
@@ -258,11 +948,18 @@ bool OSyncDataSource::report_deleted(OSyncObjTypeSink *sink, OSyncPluginInfo *in
     osync_data_unref(data);
 
     osync_context_report_change(ctx, change);
-    osync_hashtable_update_change(hashtable, change);
+    defer_hash_update(change);
 
     osync_change_unref(change);
   }
-  osync_list_free(uids);
+
+  // get_changes is done, commits change the hashtable from now on
+  hashCache.clear();
+  echoes.clear();
+
+  if ( !flush_hash_updates(sink, &error) )
+    goto error;
+
   osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
   return true;
 
@@ -284,6 +981,47 @@ OSyncDataSource::~OSyncDataSource()
 
 //--------------------------------------------------------------------------------
 
+const char *OSyncDataSource::get_advanced_option(OSyncPluginInfo *info, const char *name)
+{
+  OSyncPluginConfig *config = osync_plugin_info_get_config(info);
+  if ( !config )
+    return 0;
+
+  OSyncList *entry = osync_plugin_config_get_advancedoptions(config);
+  for (; entry; entry = entry->next)
+  {
+    OSyncPluginAdvancedOption *option = static_cast<OSyncPluginAdvancedOption*>(entry->data);
+
+    if ( strcmp(osync_plugin_advancedoption_get_name(option), name) == 0 )
+      return osync_plugin_advancedoption_get_value(option);
+  }
+  return 0;
+}
+
+//--------------------------------------------------------------------------------
+
+bool OSyncDataSource::get_advanced_option_bool(OSyncPluginInfo *info, const char *name)
+{
+  const char *value = get_advanced_option(info, name);
+  if ( !value )
+    return false;
+
+  return strcmp(value, "1") == 0 || strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0;
+}
+
+//--------------------------------------------------------------------------------
+
+unsigned int OSyncDataSource::get_advanced_option_uint(OSyncPluginInfo *info, const char *name)
+{
+  const char *value = get_advanced_option(info, name);
+  if ( !value )
+    return 0;
+
+  return strtoul(value, 0, 10);
+}
+
+//--------------------------------------------------------------------------------
+
 bool OSyncDataSource::has_category(const QStringList &list) const
 {
   if ( categories.isEmpty() ) return true;  // no filter defined -> match all
@@ -295,3 +1033,198 @@ bool OSyncDataSource::has_category(const QStringList &list) const
 }
 
 //--------------------------------------------------------------------------------
+
+/* The fingerprint is XXH64 (seed 0). Its four independent accumulator lanes
+ * over 32 byte stripes keep the multipliers of modern CPUs busy and can be
+ * vectorized by the compiler, so hashing is limited by memory bandwidth.
+ */
+
+static const Q_UINT64 PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const Q_UINT64 PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const Q_UINT64 PRIME64_3 = 0x165667B19E3779F9ULL;
+static const Q_UINT64 PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const Q_UINT64 PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline Q_UINT64 rotl64(Q_UINT64 x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline Q_UINT64 read64(const unsigned char *p)
+{
+  Q_UINT64 v;
+  memcpy(&v, p, sizeof(v));
+  return v;  // big endian hosts get other values than reference XXH64, which is fine for change detection
+}
+
+static inline Q_UINT32 read32(const unsigned char *p)
+{
+  Q_UINT32 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline Q_UINT64 xxh_round(Q_UINT64 acc, Q_UINT64 input)
+{
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline Q_UINT64 xxh_merge(Q_UINT64 acc, Q_UINT64 val)
+{
+  acc ^= xxh_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+static Q_UINT64 xxh64(const char *data, unsigned int size)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+  const unsigned char *end = p + size;
+  Q_UINT64 h;
+
+  if (size >= 32) {
+    const unsigned char *limit = end - 32;
+    Q_UINT64 v1 = PRIME64_1 + PRIME64_2;
+    Q_UINT64 v2 = PRIME64_2;
+    Q_UINT64 v3 = 0;
+    Q_UINT64 v4 = 0 - PRIME64_1;
+
+    do {
+      v1 = xxh_round(v1, read64(p));
+      v2 = xxh_round(v2, read64(p + 8));
+      v3 = xxh_round(v3, read64(p + 16));
+      v4 = xxh_round(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  }
+  else
+    h = PRIME64_5;
+
+  h += size;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= static_cast<Q_UINT64>(read32(p)) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= (*p) * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+//--------------------------------------------------------------------------------
+
+QString OSyncDataSource::fingerprint(const char *data, unsigned int size)
+{
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(xxh64(data, size)));
+  return QString::fromLatin1(buf, 16);
+}
+
+//--------------------------------------------------------------------------------
+
+QString OSyncDataSource::fingerprint(const QDateTime &stamp, const char *data, unsigned int size)
+{
+  char buf[9];
+  snprintf(buf, sizeof(buf), "%08x", stamp.isValid() ? stamp.toTime_t() : 0);
+  return QString::fromLatin1(buf, 8) + fingerprint(data, size);
+}
+
+//--------------------------------------------------------------------------------
+
+void OSyncDataSource::remove_property(QCString &data, const char *name)
+{
+  int pos = 0;
+  while ( (pos = data.find(name, pos)) >= 0 )
+  {
+    int end = data.find('\n', pos + 1);
+
+    // the continuation lines of a folded property start with white space
+    while ( end >= 0 && end + 1 < (int) data.length() && (data[end + 1] == ' ' || data[end + 1] == '\t') )
+      end = data.find('\n', end + 1);
+    data.remove(pos + 1, (end < 0 ? data.length() : end + 1) - (pos + 1));
+  }
+}
+
+//--------------------------------------------------------------------------------
+
+/** The date is taken from the first eight digits of the value, which covers
+ * both 20080131T120000Z and 2008-01-31T12:00:00Z.
+ */
+QDate OSyncDataSource::property_date(const char *data, unsigned int size, const char *name)
+{
+  unsigned int length = strlen(name);
+  const char *end = data + size;
+
+  for (const char *p = data; p + length < end; p++)
+  {
+    if ( memcmp(p, name, length) != 0 || (p[length] != ':' && p[length] != ';') )
+      continue;
+
+    // skip the parameters, e.g. DTSTART;VALUE=DATE:20080131
+    const char *value = p + length;
+    while ( value < end && *value != ':' && *value != '\n' )
+      value++;
+    if ( value == end || *value != ':' )
+      return QDate();
+
+    int digits[8];
+    int count = 0;
+    for (value++; value < end && count < 8 && *value != '\r' && *value != '\n'; value++)
+    {
+      if ( *value >= '0' && *value <= '9' )
+        digits[count++] = *value - '0';
+      else if ( *value != '-' )
+        break;
+    }
+    if ( count < 8 )
+      return QDate();
+
+    int year = digits[0] * 1000 + digits[1] * 100 + digits[2] * 10 + digits[3];
+    int month = digits[4] * 10 + digits[5];
+    int day = digits[6] * 10 + digits[7];
+    return QDate::isValid(year, month, day) ? QDate(year, month, day) : QDate();
+  }
+  return QDate();
+}
+
+//--------------------------------------------------------------------------------
+
+int OSyncDataSource::rank_of_date(const QDate &date, bool upcoming)
+{
+  if ( !date.isValid() )
+    return NO_DATE_RANK;
+
+  int days = QDate::currentDate().daysTo(date);
+  if ( upcoming && days >= 0 )
+    return days;
+  return PAST_RANK + QABS(days);
+}
+
+//--------------------------------------------------------------------------------
+
+int OSyncDataSource::change_rank(const char *, unsigned int) const
+{
+  return 0;
+}
+
+//--------------------------------------------------------------------------------
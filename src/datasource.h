@@ -2,6 +2,9 @@
 #define KDEPIM_OSYNC_DATASOURCE_H
 
 #include <qstringlist.h>
+#include <qvaluelist.h>
+#include <qcstring.h>
+#include <qdatetime.h>
 #include <opensync/opensync.h>
 #include <opensync/opensync-plugin.h>
 #include <opensync/opensync-data.h>
@@ -9,13 +12,61 @@
 #include <opensync/opensync-format.h>
 #include <opensync/opensync-capabilities.h>
 
+#include "changejournal.h"
+#include "memprofile.h"
+#include "hashcache.h"
+#include "commitjournal.h"
+#include "echotable.h"
+#include "syncbudget.h"
+
+class Prefetch;
+
+/* receives the items enumerated by a data source */
+class ItemVisitor
+{
+	public:
+		virtual ~ItemVisitor() {}
+
+		/* data is the (not necessarily 0-terminated) UTF-8 payload; return false to stop */
+		virtual bool item(const QString &uid, const char *data, unsigned int size, const QString &hash) = 0;
+
+		/* an item known to be unchanged since the last sync, without its data;
+		 * returns false if that can not be used, the item has to be read then */
+		virtual bool unchanged(const QString &uid) = 0;
+};
+
+/* passes the items on and records their uids in a journal */
+class JournalVisitor : public ItemVisitor
+{
+	public:
+		JournalVisitor(ItemVisitor &next, ChangeJournal &journal) : next(next), journal(journal) {}
+
+		virtual bool item(const QString &uid, const char *data, unsigned int size, const QString &hash)
+		{
+			journal.addUid(uid);
+			return next.item(uid, data, size, hash);
+		}
+
+		virtual bool unchanged(const QString &uid)
+		{
+			journal.addUid(uid);
+			return next.unchanged(uid);
+		}
+
+	private:
+		ItemVisitor &next;
+		ChangeJournal &journal;
+};
+
 /* common parent class and shared code for all KDE Data sources/sinks */
 class OSyncDataSource
 {
 	friend class KCalSharedResource;
+	friend class ReportVisitor;
 
 	public:
-		OSyncDataSource(const char *objtype) : objtype(objtype) {}
+		OSyncDataSource(const char *objtype)
+			: objtype(objtype), useHelper(false), textFormat(0), replayPending(false) {}
 		virtual ~OSyncDataSource();
 
                 const char *getObjType() const { return objtype; }
@@ -28,20 +79,159 @@ class OSyncDataSource
 		virtual void disconnect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx) = 0;
 		virtual void get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync) = 0;
 		virtual void commit(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *chg) = 0;
+		virtual void committed_all(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
 		virtual void sync_done(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
 
+		/* write the hashtable entries of the reported and committed changes */
+		bool flush_hash_updates(OSyncObjTypeSink *sink, OSyncError **error);
+
+		/* get_changes starts, see SyncBudget; a slow-sync sets "done" to false
+		 * until its sync_done, so that an interrupted one is repeated */
+		void begin_changes(OSyncObjTypeSink *sink, osync_bool slow_sync);
+
+		/* the content of uid as stored by a commit, see EchoTable */
+		void record_echo(const QCString &uid, const QCString &data);
+
+		/* the store was saved with all commits, see CommitJournal; a journal
+		 * left by an earlier run is kept until it was replayed */
+		void store_saved() { if (!replayPending) commits.discard(); }
+
+		/* value of the plugin's advanced option with the given name, or 0 if not set */
+		static const char *get_advanced_option(OSyncPluginInfo *info, const char *name);
+		static bool get_advanced_option_bool(OSyncPluginInfo *info, const char *name);
+		static unsigned int get_advanced_option_uint(OSyncPluginInfo *info, const char *name);
+
+		/* true if the resource of this objtype lists the given format */
+		bool resource_has_format(OSyncPluginInfo *info, const char *format) const;
+
 		// return true if at least one item in the given list is included in the categories member
 		bool has_category(const QStringList &list) const;
 
+		// false for the fields which are left out for the peer, see PeerCapabilities
+		bool peer_supports(const char *field) const;
+		bool prunes() const { return !peerFields.isEmpty(); }
+
+		/* see the MemoryProfile option */
+		MemProfile &memProfile() { return profile; }
+
 		const QStringList &getCategories() const { return categories; }
+		void setCategories(const QStringList &list) { categories = list; }
+
+		/* content fingerprints used as change detection hashes: a fast 64 bit
+		 * non-cryptographic hash over the canonical UTF-8 payload, encoded as
+		 * 16 hex digits. The variant with a timestamp prepends it as 8 hex digits,
+		 * so that a change of either the timestamp or the content is detected,
+		 * also for items which don't have a timestamp at all.
+		 */
+		static QString fingerprint(const char *data, unsigned int size);
+		static QString fingerprint(const QCString &data) { return fingerprint(data.data(), data.length()); }
+		static QString fingerprint(const QDateTime &stamp, const char *data, unsigned int size);
+
+		/* remove the lines of a text property, with its folded continuation lines;
+		 * name includes the preceding line break */
+		static void remove_property(QCString &data, const char *name);
+		/* the date a text property starts with, e.g. DTSTART or REV; invalid if
+		 * there is none. name includes the preceding line break */
+		static QDate property_date(const char *data, unsigned int size, const char *name);
 
 	protected:
 		const char *objtype;
 		QStringList categories;
+		bool useHelper;  // get the items from the kdepim-sync-helper, see synchelper.h
+		OSyncObjFormat *textFormat;  // for the items make_data() can't give as xmlformat, see report_format()
+		ChangeJournal journal;  // recorded while getting the changes, saved on sync_done
+		QStringList peerFields;  // the fields of objtype the peer can store; empty if unknown
+		MemProfile profile;  // samples at the callback boundaries, if enabled
+		HashCache hashCache;  // the hashtable as of the start of get_changes
+		EchoTable echoes;  // the items committed in the last sync
+
+		struct HashUpdate
+		{
+			QCString uid;
+			QCString hash;
+			OSyncChangeType type;
+		};
+		QValueList<HashUpdate> hashUpdates;  // written by flush_hash_updates()
+		CommitJournal commits;  // applied but not yet saved changes
+		bool replayPending;  // set until connect() replayed the journal of an earlier run
+
+		SyncBudget budget;  // see the MaxChanges and TimeBudget options
+
+		/* the order in which the held back changes are reported, lower first;
+		 * all the same unless overridden */
+		virtual int change_rank(const char *data, unsigned int size) const;
+		/* rank by the distance of date from today: with upcoming, the dates
+		 * from today on come before all past ones; without a date last */
+		static int rank_of_date(const QDate &date, bool upcoming);
+
+		/* apply a change to the store without reporting to OpenSync; ctx is 0
+		 * when replaying the commit journal. Stores without a commit journal
+		 * don't need to implement it.
+		 */
+		virtual bool apply_change(OSyncContext *ctx, OSyncChange *chg);
+		/* save the store durably; used after replaying the commit journal */
+		virtual bool save_store(OSyncContext *ctx);
+		bool replay_commits(OSyncObjTypeSink *sink, OSyncPluginInfo *info);
+		/* the hashtable might not match the store, the next sync compares all */
+		void request_slow_sync(OSyncObjTypeSink *sink);
+
+		/* fingerprint of the data without the properties which the store sets
+		 * itself, see EchoTable; of all the data unless overridden */
+		virtual QString content_fingerprint(const char *data, unsigned int size) const;
+
+		/* the data of a changed item, the bytes as they are unless overridden */
+		virtual OSyncData *make_data(const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error);
+		/* the xmlformat to report changes in if the resource lists it, else the text format */
+		OSyncObjFormat *report_format(OSyncPluginInfo *info, const char *xmlformat, const char *text);
+		/* convert the data of a received change to the given format in place */
+		bool convert_received(OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *chg, const char *format, const char *config);
 
 		/* utility functions for subclasses */
+		void load_peer_capabilities(const QString &fileName);
+		bool get_helper_items(ItemVisitor &visitor, bool &done);
+		bool get_prefetched_items(Prefetch &prefetch, unsigned int part, ItemVisitor &visitor, bool &done);
+		bool want_prefetch(OSyncPluginInfo *info) const;
+		QString journal_path(OSyncPluginInfo *info) const;
+		bool take_journal(OSyncPluginInfo *info, osync_bool slow_sync, ChangeJournal &previous);
+		bool report_unchanged(const ChangeJournal &previous, ItemVisitor &visitor);
 		bool report_change(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, QString uid, QString data, QString hash, OSyncObjFormat *objformat);
+		bool report_change(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, QString uid,
+		                   const char *data, unsigned int size, QString hash, OSyncObjFormat *objformat);
+		const char *known_hash(OSyncObjTypeSink *sink, const QCString &uid);
+		void defer_hash_update(OSyncChange *change);
+		bool deliver_change(OSyncContext *ctx, OSyncChange *change, const char *data, unsigned int size, OSyncObjFormat *objformat);
+		bool report_held_back(OSyncContext *ctx);
 		bool report_deleted(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncObjFormat *objformat);
 };
 
+/* reports every visited item with OSyncDataSource::report_change() */
+class ReportVisitor : public ItemVisitor
+{
+	public:
+		ReportVisitor(OSyncDataSource *dsobj, OSyncObjTypeSink *sink, OSyncPluginInfo *info,
+		              OSyncContext *ctx, OSyncObjFormat *objformat)
+			: dsobj(dsobj), sink(sink), info(info), ctx(ctx), objformat(objformat) {}
+
+		virtual bool item(const QString &uid, const char *data, unsigned int size, const QString &hash)
+		{
+			return dsobj->report_change(sink, info, ctx, uid, data, size, hash, objformat);
+		}
+
+		virtual bool unchanged(const QString &uid)
+		{
+			// it still has the hash of the last sync
+			const char *hash = dsobj->known_hash(sink, uid.utf8());
+			if (!hash)
+				return false;
+			return dsobj->report_change(sink, info, ctx, uid, 0, 0, QString::fromUtf8(hash), objformat);
+		}
+
+	private:
+		OSyncDataSource *dsobj;
+		OSyncObjTypeSink *sink;
+		OSyncPluginInfo *info;
+		OSyncContext *ctx;
+		OSyncObjFormat *objformat;
+};
+
 #endif // KDEPIM_OSYNC_DATASOURCE_H
@@ -0,0 +1,108 @@
+/**
+ * Recognition of committed items which are read back with another hash
+ */
+
+#include "echotable.h"
+
+static const char ECHO_KEY[] = "echoes";
+
+// the fingerprints are fixed size, see OSyncDataSource::fingerprint()
+static const unsigned int FINGERPRINT_SIZE = 16;
+
+//--------------------------------------------------------------------------------
+
+void EchoTable::load(OSyncSinkStateDB *state_db)
+{
+	entries.clear();
+	loaded = true;
+	changed = false;
+
+	OSyncError *error = NULL;
+	char *value = osync_sink_state_get(state_db, ECHO_KEY, &error);
+	if (!value) {
+		osync_trace(TRACE_INTERNAL, "no echo table: %s", osync_error_print(&error));
+		osync_error_unref(&error);
+		return;
+	}
+
+	QCString table(value);
+	osync_free(value);
+	parse(table);
+	osync_trace(TRACE_INTERNAL, "%d committed items in the echo table", entries.count());
+}
+
+//--------------------------------------------------------------------------------
+
+void EchoTable::parse(const QCString &table)
+{
+	entries.clear();
+	loaded = true;
+	changed = false;
+
+	int pos = 0;
+	while (pos < (int) table.length()) {
+		int end = table.find('\n', pos);
+		if (end < 0)
+			end = table.length();
+		if (end - pos > (int) FINGERPRINT_SIZE)
+			entries.insert(table.mid(pos + FINGERPRINT_SIZE, end - pos - FINGERPRINT_SIZE), table.mid(pos, FINGERPRINT_SIZE));
+		pos = end + 1;
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+QCString EchoTable::table() const
+{
+	QCString table;
+	for (QMap<QCString, QCString>::ConstIterator it = entries.begin(); it != entries.end(); ++it)
+		table += it.data() + it.key() + "\n";
+	return table;
+}
+
+//--------------------------------------------------------------------------------
+
+bool EchoTable::save(OSyncSinkStateDB *state_db, OSyncError **error)
+{
+	QCString table = this->table();
+	if (!osync_sink_state_set(state_db, ECHO_KEY, table.isNull() ? "" : table.data(), error))
+		return false;
+	changed = false;
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+void EchoTable::record(const QCString &uid, const QString &fingerprint)
+{
+	// a uid with a line break could not be read back
+	if (uid.isEmpty() || uid.contains('\n'))
+		return;
+
+	entries.replace(uid, fingerprint.latin1());
+	changed = true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool EchoTable::isEcho(const QCString &uid, const QString &fingerprint)
+{
+	QMap<QCString, QCString>::Iterator it = entries.find(uid);
+	if (it == entries.end())
+		return false;
+
+	bool echo = (it.data() == fingerprint.latin1());
+	entries.remove(it);
+	changed = true;
+	return echo;
+}
+
+//--------------------------------------------------------------------------------
+
+void EchoTable::clear()
+{
+	if (!entries.isEmpty())
+		changed = true;
+	entries.clear();
+	loaded = true;
+}
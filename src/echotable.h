@@ -0,0 +1,52 @@
+#ifndef KDEPIM_OSYNC_ECHOTABLE_H
+#define KDEPIM_OSYNC_ECHOTABLE_H
+
+#include <qstring.h>
+#include <qcstring.h>
+#include <qmap.h>
+#include <opensync/opensync.h>
+#include <opensync/opensync-helper.h>
+
+/* The content fingerprints of the items committed during the last sync.
+ *
+ * Reading a committed item back from the store does not always give the hash
+ * which was taken at commit time: the store rounds timestamps, writes its own
+ * revision, or sets properties when saving. Such an item would be reported
+ * back to the peer as modified on the next sync. With the fingerprint of its
+ * content as committed, leaving out those properties, the next get_changes
+ * recognizes the echo, takes the item as unchanged and only writes its new
+ * hash to the hashtable.
+ *
+ * The table lives in the sink's state database as lines of the fingerprint
+ * followed by the uid. The entries are only good for the next get_changes.
+ */
+class EchoTable
+{
+	public:
+		EchoTable() : loaded(false), changed(false) {}
+
+		void load(OSyncSinkStateDB *state_db);
+		bool save(OSyncSinkStateDB *state_db, OSyncError **error);
+		bool isLoaded() const { return loaded; }
+		bool isChanged() const { return changed; }
+
+		/* the entries as save() writes them, and read back by load() */
+		QCString table() const;
+		void parse(const QCString &table);
+
+		/* the content of uid as it was just committed */
+		void record(const QCString &uid, const QString &fingerprint);
+		bool contains(const QCString &uid) const { return entries.contains(uid); }
+		/* true if uid still has the committed content; the entry is used up */
+		bool isEcho(const QCString &uid, const QString &fingerprint);
+
+		/* get_changes is done, the entries of the last sync are not needed any more */
+		void clear();
+
+	private:
+		QMap<QCString, QCString> entries;
+		bool loaded;
+		bool changed;
+};
+
+#endif // KDEPIM_OSYNC_ECHOTABLE_H
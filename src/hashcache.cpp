@@ -0,0 +1,176 @@
+/**
+ * In-memory snapshot of a sink's hashtable
+ */
+
+#include "hashcache.h"
+
+#include <string.h>
+
+//--------------------------------------------------------------------------------
+
+/** FNV-1a, uids are short and mostly differ at the end */
+Q_UINT32 HashCache::code_of(const char *uid, unsigned int length)
+{
+	Q_UINT32 code = 2166136261U;
+	for (unsigned int i = 0; i < length; i++) {
+		code ^= (unsigned char) uid[i];
+		code *= 16777619U;
+	}
+	return code;
+}
+
+//--------------------------------------------------------------------------------
+
+void HashCache::load(OSyncHashTable *hashtable)
+{
+	clear();
+
+	// about 64 bytes of strings per entry, the pool grows if needed
+	unsigned int expected = osync_hashtable_num_entries(hashtable);
+	unsigned int capacity = 16;
+	while (capacity < 2 * expected)
+		capacity *= 2;
+	resize(capacity);
+	pool.resize(expected * 64 + 64);
+
+	osync_hashtable_foreach(hashtable, add_entry, this);
+	loaded = true;
+
+	osync_trace(TRACE_INTERNAL, "hash cache: %u entries, %u bytes of strings", entries, poolSize);
+}
+
+//--------------------------------------------------------------------------------
+
+void HashCache::clear()
+{
+	loaded = false;
+	entries = 0;
+	poolSize = 0;
+	slots.resize(0);
+	pool.resize(0);
+}
+
+//--------------------------------------------------------------------------------
+
+void HashCache::add_entry(const char *uid, const char *hash, void *cache)
+{
+	static_cast<HashCache *>(cache)->insert(uid, hash ? hash : "");
+}
+
+//--------------------------------------------------------------------------------
+
+void HashCache::insert(const char *uid, const char *hash)
+{
+	if (2 * (entries + 1) > slots.size())
+		resize(slots.size() ? 2 * slots.size() : 16);
+
+	unsigned int uidLength = strlen(uid);
+	unsigned int hashLength = strlen(hash);
+	unsigned int needed = poolSize + uidLength + hashLength + 2;
+	if (needed > pool.size()) {
+		unsigned int size = pool.size() ? pool.size() : 1024;
+		while (size < needed)
+			size *= 2;
+		pool.resize(size);
+	}
+
+	Slot slot;
+	slot.code = code_of(uid, uidLength);
+	slot.offset = poolSize + 1;
+	slot.alive = false;
+	memcpy(pool.data() + poolSize, uid, uidLength + 1);
+	memcpy(pool.data() + poolSize + uidLength + 1, hash, hashLength + 1);
+	poolSize = needed;
+
+	// the hashtable has every uid only once, so no need to look for it first
+	unsigned int mask = slots.size() - 1;
+	unsigned int i = slot.code & mask;
+	while (slots[i].offset)
+		i = (i + 1) & mask;
+	slots[i] = slot;
+	entries++;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Rehash into a table of the given size; the codes are kept, so no string is read */
+void HashCache::resize(unsigned int capacity)
+{
+	QMemArray<Slot> old = slots;
+	slots = QMemArray<Slot>(capacity);
+
+	Slot empty;
+	empty.code = 0;
+	empty.offset = 0;
+	empty.alive = false;
+	slots.fill(empty);
+
+	unsigned int mask = capacity - 1;
+	for (unsigned int o = 0; o < old.size(); o++) {
+		if (!old[o].offset)
+			continue;
+		unsigned int i = old[o].code & mask;
+		while (slots[i].offset)
+			i = (i + 1) & mask;
+		slots[i] = old[o];
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+/** Index of the slot of uid, -1 if it is unknown */
+int HashCache::slot_of(const char *uid) const
+{
+	if (!entries)
+		return -1;
+
+	Q_UINT32 code = code_of(uid, strlen(uid));
+
+	unsigned int mask = slots.size() - 1;
+	for (unsigned int i = code & mask; slots[i].offset; i = (i + 1) & mask) {
+		if (slots[i].code == code && strcmp(pool.data() + slots[i].offset - 1, uid) == 0)
+			return i;
+	}
+	return -1;
+}
+
+//--------------------------------------------------------------------------------
+
+/** The hash follows the uid in the pool */
+const char *HashCache::hash_at(int slot) const
+{
+	const char *uid = pool.data() + slots[slot].offset - 1;
+	return uid + strlen(uid) + 1;
+}
+
+//--------------------------------------------------------------------------------
+
+const char *HashCache::find(const char *uid) const
+{
+	int slot = slot_of(uid);
+	return (slot < 0) ? 0 : hash_at(slot);
+}
+
+//--------------------------------------------------------------------------------
+
+const char *HashCache::mark(const char *uid)
+{
+	int slot = slot_of(uid);
+	if (slot < 0)
+		return 0;
+
+	slots[slot].alive = true;
+	return hash_at(slot);
+}
+
+//--------------------------------------------------------------------------------
+
+QValueList<QCString> HashCache::unmarked() const
+{
+	QValueList<QCString> uids;
+	for (unsigned int i = 0; i < slots.size(); i++) {
+		if (slots[i].offset && !slots[i].alive)
+			uids.append(QCString(pool.data() + slots[i].offset - 1));
+	}
+	return uids;
+}
@@ -0,0 +1,64 @@
+#ifndef KDEPIM_OSYNC_HASHCACHE_H
+#define KDEPIM_OSYNC_HASHCACHE_H
+
+#include <qcstring.h>
+#include <qmemarray.h>
+#include <qvaluelist.h>
+#include <opensync/opensync.h>
+#include <opensync/opensync-helper.h>
+
+/* The uids and hashes of a sink's hashtable, read at once into a compact open
+ * addressing table, so that classifying the items of a large sink is a lookup
+ * in memory instead of a trip through OpenSync's hashtable per item.
+ *
+ * The strings live one after the other in a single pool, the slots only hold
+ * their offset and the hash code of the uid. The table is a snapshot; uids it
+ * does not know still have to be looked up in the hashtable itself.
+ *
+ * Every uid which is found while enumerating is marked alive; the uids left
+ * unmarked at the end are the deleted items.
+ */
+class HashCache
+{
+	public:
+		HashCache() : loaded(false), entries(0), poolSize(0) {}
+
+		void load(OSyncHashTable *hashtable);
+		void clear();
+		bool isLoaded() const { return loaded; }
+		unsigned int count() const { return entries; }
+
+		/* the hash recorded for uid, or 0 if it is unknown */
+		const char *find(const char *uid) const;
+		/* the same, and mark the uid alive */
+		const char *mark(const char *uid);
+		/* the uids which were not marked */
+		QValueList<QCString> unmarked() const;
+
+		/* add an entry as load() does for each one of the hashtable; the
+		 * hashtable has every uid only once, so uid must not be known yet */
+		void insert(const char *uid, const char *hash);
+
+	private:
+		struct Slot
+		{
+			Q_UINT32 code;    // hash code of the uid
+			Q_UINT32 offset;  // position of the uid in the pool plus 1, 0 for an empty slot
+			bool alive;       // seen while enumerating
+		};
+
+		int slot_of(const char *uid) const;
+		const char *hash_at(int slot) const;
+
+		static void add_entry(const char *uid, const char *hash, void *cache);
+		static Q_UINT32 code_of(const char *uid, unsigned int length);
+		void resize(unsigned int capacity);
+
+		bool loaded;
+		unsigned int entries;
+		QMemArray<Slot> slots;  // power of two size, at most half full
+		QByteArray pool;  // uid and hash as 0-terminated strings, per entry
+		unsigned int poolSize;  // bytes of the pool in use
+};
+
+#endif // KDEPIM_OSYNC_HASHCACHE_H
@@ -28,71 +28,601 @@ SOFTWARE IS DISCLAIMED.
  */
 
 #include "kaddrbook.h"
+#include "xmlconvert.h"
 #include <kapplication.h>
+#include <kstandarddirs.h>
 #include <kabc/vcardconverter.h>
 #include <kabc/stdaddressbook.h>
+#include <kabc/resourcefile.h>
+#include <kabc/resourcedir.h>
 #include <dcopclient.h>
-
-/** Calculate the hash value for an Addressee.
+#include <qfile.h>
+#include <qdir.h>
+#include <qvaluelist.h>
+#include <qptrlist.h>
+
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/** contacts are handed to the framework as xml if the resource lists it, see make_data() */
+static const char XMLFORMAT_CONTACT[] = "xmlformat-contact";
+
+/** received contacts are converted to vcards with the extensions of KAddressBook */
+static const char VCARD_CONFIG[] = "VCARD_EXTENSION=KDE";
+
+/** Calculate the hash value for an Addressee from its vcard.
  * Should be called before returning/writing the
  * data, because the revision of the Addressee
  * can be changed.
+ *
+ * In rawMode the hash must be calculated over exactly the bytes which are stored
+ * in the vcf file, so that a card written by commit() is recognized unchanged when
+ * it is read back raw on the next sync; the revision is part of these bytes anyway.
  */
-QString KContactDataSource::calc_hash(KABC::Addressee &e)
+QString KContactDataSource::calc_hash(const KABC::Addressee &e, const QCString &vcard) const
 {
-	//Get the revision date of the KDE addressbook entry.
-	QDateTime revdate = e.revision();
-	if ( !revdate.isValid() ) {
-                // if no revision is available, always return the same 0-time stamp
-          	// to avoid that 2 calls deliver different times which would be treated as changed entry
-		revdate.setTime_t(0);
-		//e.setRevision(revdate);
-	}
+	if (rawMode())
+		return fingerprint(vcard);
 
-	return revdate.toString(Qt::ISODate);
+	// the content covers entries without a revision and edits which didn't update it
+	return fingerprint(e.revision(), vcard.data(), vcard.length());
 }
 
 //--------------------------------------------------------------------------------
 
-void KContactDataSource::connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx)
+/** Leave out the large fields which the peer can not store */
+void KContactDataSource::prune(KABC::Addressee &e) const
 {
-	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __PRETTY_FUNCTION__, info, ctx);
+	if (!peer_supports("Photo"))
+		e.setPhoto(KABC::Picture());
+	if (!peer_supports("Logo"))
+		e.setLogo(KABC::Picture());
+	if (!peer_supports("Sound"))
+		e.setSound(KABC::Sound());
+	if (!peer_supports("Key")) {
+		KABC::Key::List keys = e.keys();
+		for (KABC::Key::List::ConstIterator it = keys.begin(); it != keys.end(); ++it)
+			e.removeKey(*it);
+	}
+	if (!peer_supports("Note"))
+		e.setNote(QString::null);
+}
 
-	// get a handle to the standard KDE addressbook
-	addressbookptr = KABC::StdAddressBook::self(false);  // load synchronously
-	KABC::StdAddressBook::setAutomaticSave(false);  // only when modified
-	modified = false;
+//--------------------------------------------------------------------------------
+
+/** Take the pruned fields over from the stored addressee, as the peer never saw them */
+void KContactDataSource::restore_pruned(KABC::Addressee &e, const KABC::Addressee &old) const
+{
+	if (!peer_supports("Photo"))
+		e.setPhoto(old.photo());
+	if (!peer_supports("Logo"))
+		e.setLogo(old.logo());
+	if (!peer_supports("Sound"))
+		e.setSound(old.sound());
+	if (!peer_supports("Key")) {
+		KABC::Key::List keys = old.keys();
+		for (KABC::Key::List::ConstIterator it = keys.begin(); it != keys.end(); ++it)
+			e.insertKey(*it);
+	}
+	if (!peer_supports("Note"))
+		e.setNote(old.note());
+}
+
+//--------------------------------------------------------------------------------
+
+/** One card inside a memory mapped vcf file */
+struct RawVCard
+{
+	const char *data;
+	unsigned int size;
+	QString uid;
+};
 
-	ticket = addressbookptr->requestSaveTicket();
-	if ( !ticket ) {
-		osync_context_report_error(ctx, OSYNC_ERROR_NOT_SUPPORTED, "Unable to get save ticket for addressbook");
-		osync_trace(TRACE_EXIT_ERROR, "%s: Unable to get save ticket for addressbook", __PRETTY_FUNCTION__);
+/** A read-only memory mapping of a vcf file, which is split into cards by byte offsets */
+class RawVCardFile
+{
+	public:
+		RawVCardFile(const QString &fileName);
+		~RawVCardFile();
+
+		/** Append all cards of the file to the list.
+		 * Returns false if the file can't be read or contains a card without UID, as
+		 * KABC would invent a new UID for such a card on every load.
+		 */
+		bool split(QValueList<RawVCard> &cards) const;
+
+	private:
+		QString fileName;
+		const char *map;
+		size_t size;
+		bool ok;
+};
+
+RawVCardFile::RawVCardFile(const QString &fileName)
+	: fileName(fileName), map(0), size(0), ok(false)
+{
+	int fd = ::open(QFile::encodeName(fileName), O_RDONLY);
+	if (fd < 0)
 		return;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0) {
+		size = st.st_size;
+		if (size == 0)
+			ok = true;
+		else {
+			void *addr = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (addr != MAP_FAILED) {
+				madvise(addr, size, MADV_SEQUENTIAL);
+				map = static_cast<const char *>(addr);
+				ok = true;
+			}
+		}
 	}
+	::close(fd);
+}
 
-	OSyncDataSource::connect(sink, info, ctx);
+RawVCardFile::~RawVCardFile()
+{
+	if (map)
+		munmap(const_cast<char *>(map), size);
+}
 
-	osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
+static inline bool line_starts_with(const char *line, const char *eol, const char *tag, unsigned int len)
+{
+	return static_cast<unsigned int>(eol - line) >= len && strncasecmp(line, tag, len) == 0;
+}
+
+static inline const char *end_of_line(const char *line, const char *end)
+{
+	const char *eol = static_cast<const char *>(memchr(line, '\n', end - line));
+	return eol ? eol : end;
+}
+
+/** Extract the unfolded UID value of the card [card, end) */
+static QString raw_vcard_uid(const char *card, const char *end)
+{
+	for (const char *line = card; line < end; ) {
+		const char *eol = end_of_line(line, end);
+
+		if (line_starts_with(line, eol, "UID:", 4) || line_starts_with(line, eol, "UID;", 4)) {
+			const char *colon = static_cast<const char *>(memchr(line, ':', eol - line));
+			if (!colon)
+				return QString::null;
+
+			const char *value = colon + 1;
+			QCString uid;
+
+			for (;;) {
+				const char *stop = (eol > value && eol[-1] == '\r') ? eol - 1 : eol;
+				uid += QCString(value, stop - value + 1);
+
+				// folded continuation lines start with a space or tab
+				if (eol + 1 >= end || (eol[1] != ' ' && eol[1] != '\t'))
+					break;
+				value = eol + 2;
+				eol = end_of_line(value, end);
+			}
+			return QString::fromUtf8(uid);
+		}
+
+		line = eol + 1;
+	}
+	return QString::null;
+}
+
+bool RawVCardFile::split(QValueList<RawVCard> &cards) const
+{
+	if (!ok) {
+		osync_trace(TRACE_INTERNAL, "Unable to map %s", (const char *)QFile::encodeName(fileName));
+		return false;
+	}
+
+	const char *end = map + size;
+	const char *card = 0;
+
+	for (const char *line = map; line < end; ) {
+		const char *eol = end_of_line(line, end);
+		const char *next = (eol < end) ? eol + 1 : end;
+
+		if (!card) {
+			if (line_starts_with(line, eol, "BEGIN:VCARD", 11))
+				card = line;
+		}
+		else if (line_starts_with(line, eol, "END:VCARD", 9)) {
+			RawVCard raw;
+			raw.data = card;
+			raw.size = next - card;
+			raw.uid = raw_vcard_uid(card, next);
+			if (raw.uid.isEmpty()) {
+				osync_trace(TRACE_INTERNAL, "Card without UID in %s", (const char *)QFile::encodeName(fileName));
+				return false;
+			}
+			cards.append(raw);
+			card = 0;
+		}
+
+		line = next;
+	}
+	return true;
 }
 
 //--------------------------------------------------------------------------------
 
-void KContactDataSource::disconnect(OSyncObjTypeSink *, OSyncPluginInfo *info, OSyncContext *ctx)
+/** Collect the files of all addressbook resources.
+ * Returns false if one of the resources is not a plain vcard file or vcard directory,
+ * in which case the cards can not be reported verbatim.
+ */
+bool KContactDataSource::raw_vcard_files(QStringList &files) const
 {
-	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __PRETTY_FUNCTION__, info, ctx);
+	files.clear();
 
-	if ( modified ) {
-		if ( !addressbookptr->save(ticket) ) {
-			osync_context_report_error(ctx, OSYNC_ERROR_NOT_SUPPORTED, "Unable to use ticket on addressbook");
-			osync_trace(TRACE_EXIT_ERROR, "%s: Unable to save", __PRETTY_FUNCTION__);
-			return;
+	QPtrList<KABC::Resource> resources = addressbookptr->resources();
+	if (resources.isEmpty())
+		return false;
+
+	for (QPtrListIterator<KABC::Resource> it(resources); it.current(); ++it) {
+		KABC::Resource *res = it.current();
+
+		if (res->type() == "file") {
+			KABC::ResourceFile *file = static_cast<KABC::ResourceFile *>(res);
+			if (file->format() != "vcard")
+				return false;
+			files.append(file->fileName());
+		}
+		else if (res->type() == "dir") {
+			KABC::ResourceDir *dir = static_cast<KABC::ResourceDir *>(res);
+			if (dir->format() != "vcard")
+				return false;
+
+			QDir d(dir->path());
+			QStringList entries = d.entryList(QDir::Files);
+			for (QStringList::ConstIterator e = entries.begin(); e != entries.end(); ++e)
+				files.append(d.filePath(*e));
+		}
+		else
+			return false;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Map a vcf file and append its cards, recording them in the journal */
+bool KContactDataSource::map_raw_vcards(const QString &fileName, QPtrList<RawVCardFile> &maps, QValueList<RawVCard> &cards)
+{
+	RawVCardFile *file = new RawVCardFile(fileName);
+	maps.append(file);
+
+	QValueList<RawVCard> fileCards;
+	if (!file->split(fileCards))
+		return false;
+
+	QStringList uids;
+	for (QValueList<RawVCard>::ConstIterator it = fileCards.begin(); it != fileCards.end(); ++it) {
+		uids.append((*it).uid);
+		cards.append(*it);
+	}
+	journal.record(fileName, uids);
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Visit all cards of the raw vcard files without going through KABC::Addressee.
+ * Files which did not change according to the previous journal are not read at
+ * all, their cards are visited as unchanged.
+ * If one of the files can not be split into cards, nothing is visited and usable
+ * is set to false so that the caller can fall back to the converter.
+ */
+bool KContactDataSource::enumerate_raw_vcards(ItemVisitor &visitor, const ChangeJournal *previous, bool &usable)
+{
+	QPtrList<RawVCardFile> maps;
+	maps.setAutoDelete(true);
+	QValueList<RawVCard> cards;
+	QStringList unchangedFiles;
+
+	usable = true;
+	for (QStringList::ConstIterator it = rawFiles.begin(); it != rawFiles.end(); ++it) {
+		if (previous && previous->unchanged(*it)) {
+			unchangedFiles.append(*it);
+			continue;
 		}
+		if (!map_raw_vcards(*it, maps, cards)) {
+			usable = false;
+			return false;
+		}
+	}
+
+	osync_trace(TRACE_INTERNAL, "Reporting %d raw vcards from %d files, %d files unchanged",
+	            cards.count(), rawFiles.count() - unchangedFiles.count(), unchangedFiles.count());
+
+	for (QStringList::ConstIterator it = unchangedFiles.begin(); it != unchangedFiles.end(); ++it) {
+		QStringList uids = previous->uids(*it);
+		QStringList::ConstIterator u = uids.begin();
+		while (u != uids.end() && visitor.unchanged(*u))
+			++u;
+
+		if (u == uids.end())
+			journal.record(*it, uids);
+		else if (!map_raw_vcards(*it, maps, cards))  // unknown to the hashtable, so read it after all
+			return false;
+	}
+
+	for (QValueList<RawVCard>::ConstIterator it = cards.begin(); it != cards.end(); ++it) {
+		if (!visitor.item((*it).uid, (*it).data, (*it).size, fingerprint((*it).data, (*it).size)))
+			return false;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Visit all addressees which match the category filter, converted to vcard 3.0 */
+bool KContactDataSource::enumerate_addressees(ItemVisitor &visitor)
+{
+	KABC::VCardConverter converter;
+	for (KABC::AddressBook::Iterator it=addressbookptr->begin(); it!=addressbookptr->end(); it++ ) {
+
+		if ( ! has_category((*it).categories()) )
+			continue;
+
+		KABC::Addressee e = *it;
+		if (prunes())
+			prune(e);
+
+		// Convert the VCARD data into a string
+		// only vcard3.0 exports Categories
+		QCString data = converter.createVCard(e, KABC::VCardConverter::v3_0).utf8();
+		QString hash = calc_hash(e, data);
+
+		visited = &e;
+		bool ok = visitor.item(it->uid(), data.data(), data.length(), hash);
+		visited = 0;
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Start recording the journal with the resources and their configuration */
+void KContactDataSource::begin_journal()
+{
+	journal.begin(loadTime);
+
+	QStringList paths;
+	if (!resource_paths(paths))
+		journal.invalidate();
+	paths.append(locateLocal("config", "kresources/contact/stdrc"));
+	journal.recordPaths(paths);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Visit all contacts which have to be reported, the addressbook must be loaded.
+ * With a journal of the previous sync, unchanged raw vcard files are skipped.
+ */
+bool KContactDataSource::enumerate(ItemVisitor &visitor, const ChangeJournal *previous)
+{
+	if (rawMode()) {
+		bool usable;
+		bool ok = enumerate_raw_vcards(visitor, previous, usable);
+		if (usable)
+			return ok;
+
+		osync_trace(TRACE_INTERNAL, "raw vcard files not usable, falling back to converter");
+		if (journal.isValid())
+			begin_journal();
+	}
+
+	JournalVisitor recorder(visitor, journal);
+	return enumerate_addressees(recorder);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Runs in the prefetch child: load and serialize all contacts */
+bool KContactDataSource::produce(int fd)
+{
+	if (!load(0, false))
+		return false;
+
+	begin_journal();
+
+	if (!Prefetch::writeHeader(fd, 1))
+		return false;
+
+	CollectVisitor collector(fd);
+	return enumerate(collector) && collector.finish() && Prefetch::writeJournal(fd, journal);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Load the addressbook on first use.
+ * With forWriting, a save ticket is requested as well, which keeps the addressbook
+ * locked until disconnect. ctx may be 0 when used outside of a sync.
+ */
+bool KContactDataSource::load(OSyncContext *ctx, bool forWriting)
+{
+	if (!addressbookptr) {
+		loadTime = ChangeJournal::now();
+
+		// get a handle to the standard KDE addressbook
+		addressbookptr = KABC::StdAddressBook::self(false);  // load synchronously
+		KABC::StdAddressBook::setAutomaticSave(false);  // only when modified
+		modified = false;
+
+		rawResources = raw_vcard_files(rawFiles);
+		osync_trace(TRACE_INTERNAL, "raw vcard resources: %s", rawResources ? "yes" : "no");
+		profile.mark("load");
 	}
-	else {
+
+	if (forWriting && !ticket) {
+		ticket = addressbookptr->requestSaveTicket();
+		if ( !ticket ) {
+			if (ctx)
+				osync_context_report_error(ctx, OSYNC_ERROR_NOT_SUPPORTED, "Unable to get save ticket for addressbook");
+			osync_trace(TRACE_INTERNAL, "Unable to get save ticket for addressbook");
+			return false;
+		}
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Collect the files and directories backing the loaded addressbook.
+ * Returns false if one of the resources is not stored in local files.
+ */
+bool KContactDataSource::resource_paths(QStringList &paths) const
+{
+	bool local = true;
+	QPtrList<KABC::Resource> resources = addressbookptr->resources();
+	for (QPtrListIterator<KABC::Resource> it(resources); it.current(); ++it) {
+		KABC::Resource *res = it.current();
+
+		if (res->type() == "file")
+			paths.append(static_cast<KABC::ResourceFile *>(res)->fileName());
+		else if (res->type() == "dir")
+			paths.append(static_cast<KABC::ResourceDir *>(res)->path());
+		else
+			local = false;
+	}
+	return local;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Forget the loaded addressbook without saving, so that the next load() reads it again */
+void KContactDataSource::unload()
+{
+	if (!addressbookptr)
+		return;
+
+	// written() still needs the addressbook to release its ticket
+	if (savingTicket)
+		BackgroundSave::reap(true);
+
+	if (ticket)
 		addressbookptr->releaseSaveTicket(ticket);
+	ticket = 0;
+
+	KABC::StdAddressBook::close();
+	addressbookptr = 0;
+}
+
+//--------------------------------------------------------------------------------
+
+void KContactDataSource::connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __PRETTY_FUNCTION__, info, ctx);
+
+	// a commit journal left by an interrupted sync is replayed first
+	OSyncDataSource::connect(sink, info, ctx);
+
+	// the addressbook is only loaded when it is needed, as the helper might
+	// deliver the changes and there might be nothing to commit; until get_changes
+	// is called, a child loads and serializes it next to the other sinks
+	if (want_prefetch(info))
+		prefetch.start(*this);
+
+	osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Save the addressbook if something was committed, and release the ticket.
+ * The commit journal is only dropped once the files are known to be on disk.
+ */
+bool KContactDataSource::save_store(OSyncContext *ctx)
+{
+	bool durable = true;
+	if ( ticket ) {
+		if ( modified ) {
+			if ( !addressbookptr->save(ticket) ) {
+				if (ctx)
+					osync_context_report_error(ctx, OSYNC_ERROR_NOT_SUPPORTED, "Unable to use ticket on addressbook");
+				return false;
+			}
+
+			// remote resources are as durable as they get once saved without error
+			QStringList paths;
+			resource_paths(paths);
+			durable = CommitJournal::syncFiles(paths);
+		}
+		else {
+			addressbookptr->releaseSaveTicket(ticket);
+		}
 	}
 
 	ticket = 0;
+	modified = false;
+
+	if (durable)
+		store_saved();
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Save the addressbook with the ticket and sync its files, see BackgroundSave.
+ * Only the resource is saved: a lock file can only be removed by the process
+ * which made it, so the ticket is released in written().
+ */
+bool KContactDataSource::write()
+{
+	if ( !savingTicket->resource()->save(savingTicket) )
+		return false;
+
+	QStringList paths;
+	resource_paths(paths);
+	return CommitJournal::syncFiles(paths);
+}
+
+//--------------------------------------------------------------------------------
+
+void KContactDataSource::written(bool ok)
+{
+	if (addressbookptr)
+		addressbookptr->releaseSaveTicket(savingTicket);
+	savingTicket = 0;
+
+	if (ok)
+		store_saved();
+	else
+		osync_trace(TRACE_INTERNAL, "Unable to save the addressbook, the commit journal is kept");
+}
+
+//--------------------------------------------------------------------------------
+
+void KContactDataSource::disconnect(OSyncObjTypeSink *, OSyncPluginInfo *info, OSyncContext *ctx)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __PRETTY_FUNCTION__, info, ctx);
+
+	prefetch.cancel();
+
+	// the addressbook is written by a child while the remaining sinks go on;
+	// the ticket is kept until the save is done
+	if ( ticket && modified ) {
+		savingTicket = ticket;
+		ticket = 0;
+		modified = false;
+		BackgroundSave::start(*this, ctx);
+		osync_trace(TRACE_EXIT, "%s: saving in the background", __PRETTY_FUNCTION__);
+		return;
+	}
+
+	if ( !save_store(ctx) ) {
+		osync_trace(TRACE_EXIT_ERROR, "%s: Unable to save", __PRETTY_FUNCTION__);
+		return;
+	}
 
 	osync_context_report_success(ctx);
 	osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
@@ -118,25 +648,31 @@ void KContactDataSource::get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *in
 		}
 	}
 
-	OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
-	OSyncObjFormat *objformat = osync_format_env_find_objformat(formatenv, "vcard30");
-
-	KABC::VCardConverter converter;
-	for (KABC::AddressBook::Iterator it=addressbookptr->begin(); it!=addressbookptr->end(); it++ ) {
-
-		if ( ! has_category((*it).categories()) )
-			continue;
-
-		// Convert the VCARD data into a string
-		// only vcard3.0 exports Categories
-		QString data = converter.createVCard(*it, KABC::VCardConverter::v3_0);
-
-		if (!report_change(sink, info, ctx, it->uid(), data, calc_hash(*it), objformat)) {
-
-			osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Failed to get changes");
-			osync_trace(TRACE_EXIT_ERROR, "%s", __PRETTY_FUNCTION__);
+	OSyncObjFormat *objformat = report_format(info, XMLFORMAT_CONTACT, "vcard30");
+
+	ChangeJournal previous;
+	bool havePrevious = take_journal(info, slow_sync, previous);
+
+	ReportVisitor reporter(this, sink, info, ctx, objformat);
+	bool done = havePrevious && report_unchanged(previous, reporter);
+	bool ok = true;
+	if (!done)
+		ok = get_prefetched_items(prefetch, 0, reporter, done);
+	if (ok && !done)
+		ok = get_helper_items(reporter, done);
+	if (ok && !done) {
+		if (!load(ctx, true)) {
+			osync_trace(TRACE_EXIT_ERROR, "%s: Unable to load addressbook", __PRETTY_FUNCTION__);
 			return;
 		}
+		begin_journal();
+		ok = enumerate(reporter, havePrevious ? &previous : 0);
+	}
+
+	if (!ok) {
+		osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Failed to get changes");
+		osync_trace(TRACE_EXIT_ERROR, "%s", __PRETTY_FUNCTION__);
+		return;
 	}
 
 	if (!report_deleted(sink, info, ctx, objformat)) {
@@ -151,9 +687,14 @@ void KContactDataSource::get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *in
 
 //--------------------------------------------------------------------------------
 
-void KContactDataSource::commit(OSyncObjTypeSink *sink, OSyncPluginInfo *, OSyncContext *ctx, OSyncChange *chg)
+/** Apply a change to the addressbook; ctx is 0 when replaying the commit journal */
+bool KContactDataSource::apply_change(OSyncContext *ctx, OSyncChange *chg)
 {
-	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __PRETTY_FUNCTION__, ctx, chg);
+	if (!load(ctx, true)) {
+		osync_trace(TRACE_INTERNAL, "Unable to load addressbook");
+		return false;
+	}
+
 	KABC::VCardConverter converter;
 
 	// convert VCARD string from obj->comp into an Addresse object.
@@ -185,25 +726,45 @@ void KContactDataSource::commit(OSyncObjTypeSink *sink, OSyncPluginInfo *, OSync
 			// ensure it has the correct UID
 			addressee.setUid(uid);
 
-			// replace the current addressbook entry (if any) with the new one
-                        // this changes the revision inside the KDE-addressbook
-			addressbookptr->insertAddressee(addressee);
+			KABC::Addressee old = addressbookptr->findByUid(uid);
+			if (prunes() && !old.isEmpty())
+				restore_pruned(addressee, old);
+
+			// an entry with the same content is left alone, so that neither its
+			// revision nor the resource changes; KABC can only replace whole entries
+			KABC::Addressee compared = addressee;
+			compared.setRevision(old.revision());
+			compared.setResource(old.resource());
+			if (!old.isEmpty() && compared == old) {
+				osync_trace(TRACE_INTERNAL, "KDE ADDRESSBOOK ENTRY UNCHANGED (UID=%s)", (const char *)uid.utf8());
+			}
+			else {
+				// replace the current addressbook entry (if any) with the new one
+				// this changes the revision inside the KDE-addressbook
+				addressbookptr->insertAddressee(addressee);
 
-			modified = true;
-			osync_trace(TRACE_INTERNAL, "KDE ADDRESSBOOK ENTRY UPDATED (UID=%s)", (const char *)uid.utf8());
+				modified = true;
+				osync_trace(TRACE_INTERNAL, "KDE ADDRESSBOOK ENTRY UPDATED (UID=%s)", (const char *)uid.utf8());
+			}
 
                         // read out the set addressee to get the new revision
 			KABC::Addressee addresseeNew = addressbookptr->findByUid(uid);
+			if (prunes())
+				prune(addresseeNew);
 
-			QString hash = calc_hash(addresseeNew);
+			// this is also what the vcard resource will write into the file
+			QCString vcard = converter.createVCard(addresseeNew, KABC::VCardConverter::v3_0).utf8();
+			QString hash = calc_hash(addresseeNew, vcard);
 			osync_change_set_hash(chg, hash.utf8());
+			record_echo(uid.utf8(), vcard);
 			break;
 		}
 		case OSYNC_CHANGE_TYPE_DELETED: {
 			if (uid.isEmpty()) {
-				osync_context_report_error(ctx, OSYNC_ERROR_FILE_NOT_FOUND, "Trying to delete entry with empty UID");
-				osync_trace(TRACE_EXIT_ERROR, "%s: Trying to delete but uid is empty", __PRETTY_FUNCTION__);
-				return;
+				if (ctx)
+					osync_context_report_error(ctx, OSYNC_ERROR_FILE_NOT_FOUND, "Trying to delete entry with empty UID");
+				osync_trace(TRACE_INTERNAL, "Trying to delete but uid is empty");
+				return false;
 			}
 
 			//find addressbook entry with matching UID and delete it
@@ -217,14 +778,76 @@ void KContactDataSource::commit(OSyncObjTypeSink *sink, OSyncPluginInfo *, OSync
 			break;
 		}
 		default: {
-			osync_context_report_error(ctx, OSYNC_ERROR_NOT_SUPPORTED, "Operation not supported");
-			osync_trace(TRACE_EXIT_ERROR, "%s: Operation not supported", __PRETTY_FUNCTION__);
-			return;
+			if (ctx)
+				osync_context_report_error(ctx, OSYNC_ERROR_NOT_SUPPORTED, "Operation not supported");
+			osync_trace(TRACE_INTERNAL, "Operation not supported");
+			return false;
 		}
 	}
+	return true;
+}
 
-	OSyncHashTable *hashtable = osync_objtype_sink_get_hashtable(sink);
-	osync_hashtable_update_change(hashtable, chg);
+//--------------------------------------------------------------------------------
+
+/** The revision is left out, KABC sets it on every insert */
+QString KContactDataSource::content_fingerprint(const char *data, unsigned int size) const
+{
+	QCString content(data, size + 1);
+	remove_property(content, "\nREV");
+	return fingerprint(content);
+}
+
+//--------------------------------------------------------------------------------
+
+/** The recently modified contacts first */
+int KContactDataSource::change_rank(const char *data, unsigned int size) const
+{
+	return rank_of_date(property_date(data, size, "\nREV"), false);
+}
+
+//--------------------------------------------------------------------------------
+
+/** With xmlformat-contact, the fields of the addressee being enumerated go to
+ * the framework right away, instead of as a vcard which it parses into the same
+ * fields again. Raw vcards, prefetched and held back items only exist as text,
+ * they go as their vcard, as does an addressee with fields which XMLConvert
+ * does not map.
+ */
+OSyncData *KContactDataSource::make_data(const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error)
+{
+	if (!data || strcmp(osync_objformat_get_name(objformat), XMLFORMAT_CONTACT) != 0)
+		return OSyncDataSource::make_data(data, size, objformat, error);
+
+	if (!visited || !XMLConvert::covers(*visited))
+		return OSyncDataSource::make_data(data, size, textFormat, error);
+
+	OSyncXMLFormat *xmlformat = XMLConvert::fromAddressee(objtype, *visited, error);
+	return xmlformat ? XMLConvert::toData(xmlformat, objformat, error) : 0;
+}
+
+//--------------------------------------------------------------------------------
+
+void KContactDataSource::commit(OSyncObjTypeSink *, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *chg)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __PRETTY_FUNCTION__, ctx, chg);
+
+	if (!convert_received(info, ctx, chg, "vcard30", VCARD_CONFIG)) {
+		osync_trace(TRACE_EXIT_ERROR, "%s: Unable to convert the change", __PRETTY_FUNCTION__);
+		return;
+	}
+
+	if (!apply_change(ctx, chg)) {
+		osync_trace(TRACE_EXIT_ERROR, "%s: Unable to apply the change", __PRETTY_FUNCTION__);
+		return;
+	}
+
+	// durable before the hashtable learns about it, see flush_hash_updates()
+	if (!commits.append(chg)) {
+		osync_context_report_error(ctx, OSYNC_ERROR_IO_ERROR, "Unable to record the commit in the journal");
+		osync_trace(TRACE_EXIT_ERROR, "%s: Unable to record the commit in the journal", __PRETTY_FUNCTION__);
+		return;
+	}
+	defer_hash_update(chg);
 
 	osync_context_report_success(ctx);
 	osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
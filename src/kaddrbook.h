@@ -25,25 +25,65 @@ SOFTWARE IS DISCLAIMED.
 
 #include <kabc/resource.h>
 
+#include <qptrlist.h>
+#include <qvaluelist.h>
+
 #include "datasource.h"
+#include "prefetch.h"
+#include "backgroundsave.h"
+
+struct RawVCard;
+class RawVCardFile;
 
-class KContactDataSource : public OSyncDataSource
+class KContactDataSource : public OSyncDataSource, public Prefetch::Producer, public BackgroundSave::Writer
 {
 	public:
-		KContactDataSource() : OSyncDataSource("contact"), addressbookptr(0), modified(false), ticket(0) {};
+		KContactDataSource() : OSyncDataSource("contact"), addressbookptr(0), modified(false), ticket(0), savingTicket(0), rawResources(false), loadTime(0), visited(0) {};
 		virtual ~KContactDataSource() {};
 
 		virtual void connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
 		virtual void disconnect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
 		virtual void get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync);
 		virtual void commit(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *chg);
+		virtual bool apply_change(OSyncContext *ctx, OSyncChange *chg);
+		virtual bool save_store(OSyncContext *ctx);
+		virtual QString content_fingerprint(const char *data, unsigned int size) const;
+		virtual int change_rank(const char *data, unsigned int size) const;
+		virtual OSyncData *make_data(const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error);
+
+		bool load(OSyncContext *ctx, bool forWriting);
+		void unload();
+		bool enumerate(ItemVisitor &visitor, const ChangeJournal *previous = 0);
+		bool resource_paths(QStringList &paths) const;
+
+		virtual bool produce(int fd);
+		virtual bool write();
+		virtual void written(bool ok);
 
 	private:
-		QString calc_hash(KABC::Addressee &e);
+		// without a category filter or pruning, the cards of raw resources are reported verbatim
+		bool rawMode() const { return rawResources && categories.isEmpty() && !prunes(); }
+
+		void prune(KABC::Addressee &e) const;
+		void restore_pruned(KABC::Addressee &e, const KABC::Addressee &old) const;
+
+		QString calc_hash(const KABC::Addressee &e, const QCString &vcard) const;
+
+		bool enumerate_addressees(ItemVisitor &visitor);
+		bool raw_vcard_files(QStringList &files) const;
+		bool enumerate_raw_vcards(ItemVisitor &visitor, const ChangeJournal *previous, bool &usable);
+		bool map_raw_vcards(const QString &fileName, QPtrList<RawVCardFile> &maps, QValueList<RawVCard> &cards);
+		void begin_journal();
 
                 KABC::AddressBook* addressbookptr;
                 bool modified;  // set when needed to save addressbook back
                 KABC::Ticket *ticket;
+                KABC::Ticket *savingTicket;  // held by a BackgroundSave until written()
+                bool rawResources;  // all resources are plain vcard files
+                QStringList rawFiles;  // the vcard files backing the addressbook then
+                Q_INT64 loadTime;  // when loading started, see ChangeJournal
+                const KABC::Addressee *visited;  // the addressee being reported, see make_data()
+                Prefetch prefetch;
 };
 
 #endif
@@ -31,19 +31,47 @@ SOFTWARE IS DISCLAIMED.
 #include <libkcal/resourcecalendar.h>
 #include <libkcal/icalformat.h>
 #include <libkcal/calendarlocal.h>
+#include <kconfig.h>
+#include <kurl.h>
+#include <kstandarddirs.h>
+#include <qfile.h>
+
+#include <string.h>
+
+#include "xmlconvert.h"
+
+/** events and to-dos are handed to the framework as xml if the resource lists it, see make_data() */
+static const char XMLFORMAT_EVENT[] = "xmlformat-event";
+static const char XMLFORMAT_TODO[] = "xmlformat-todo";
+
+//--------------------------------------------------------------------------------
+
+bool KCalSharedResource::open(OSyncContext *)
+{
+	if (refcount == 0)
+		profile.begin();
+
+	// the calendar itself is loaded on first use, see load()
+	refcount++;
+	profile.mark("open");
+	return true;
+}
 
 //--------------------------------------------------------------------------------
 
-bool KCalSharedResource::open(OSyncContext *ctx)
+/** Load the calendar, if not done yet. ctx may be 0 when used outside of a sync */
+bool KCalSharedResource::load(OSyncContext *ctx)
 {
-	if (refcount++ > 0) {
-		assert(calendar);
+	if (calendar)
 		return true;
-	}
+
+	loadTime = ChangeJournal::now();
+	modified = false;
 
 	calendar = new KCal::CalendarResources(QString::fromLatin1( "UTC" ));
 	if (!calendar) {
-		osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Can't open KDE calendar");
+		if (ctx)
+			osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Can't open KDE calendar");
 		return false;
 	}
 	calendar->readConfig();
@@ -51,35 +79,324 @@ bool KCalSharedResource::open(OSyncContext *ctx)
 	calendar->setStandardDestinationPolicy();
 	calendar->setModified(false);
 
+	profile.mark("load");
 	return true;
 }
 
 //--------------------------------------------------------------------------------
 
-bool KCalSharedResource::close(OSyncContext *)
+/** Register the data source of events or to-dos, which selects the incidences to prefetch */
+void KCalSharedResource::attach(OSyncDataSource *dsobj)
 {
-	if (--refcount > 0)
-		return true;
+	if (strcmp(dsobj->getObjType(), "event") == 0)
+		eventSource = dsobj;
+	else
+		todoSource = dsobj;
+}
 
-	/* Save the changes */
-	calendar->save();
+//--------------------------------------------------------------------------------
 
+/** Start loading and serializing the calendar in a child, once for events and to-dos */
+void KCalSharedResource::start_prefetch()
+{
+	if (!calendar && !prefetch.isStarted())
+		prefetch.start(*this);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Runs in the prefetch child: load and serialize the events and to-dos */
+bool KCalSharedResource::produce(int fd)
+{
+	if (!load(0))
+		return false;
+
+	if (!Prefetch::writeHeader(fd, TodoPart + 1))
+		return false;
+
+	for (int part = EventPart; part <= TodoPart; part++) {
+		const OSyncDataSource *dsobj = (part == EventPart) ? eventSource : todoSource;
+
+		ChangeJournal journal;
+		CollectVisitor collector(fd);
+
+		// the part of a disabled objtype stays empty
+		if (dsobj) {
+			begin_journal(journal);
+			JournalVisitor recorder(collector, journal);
+			bool ok = (part == EventPart) ? enumerate_events(dsobj, recorder) : enumerate_todos(dsobj, recorder);
+			if (!ok)
+				return false;
+		}
+		if (!collector.finish() || !Prefetch::writeJournal(fd, journal))
+			return false;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Collect the files and directories backing the loaded calendar.
+ * Returns false if one of the active resources is not stored in local files.
+ */
+bool KCalSharedResource::resource_paths(QStringList &paths) const
+{
+	bool local = true;
+	KCal::CalendarResourceManager *manager = calendar->resourceManager();
+	for (KCal::CalendarResourceManager::ActiveIterator it = manager->activeBegin(); it != manager->activeEnd(); ++it) {
+		KCal::ResourceCalendar *res = *it;
+
+		if (res->type() != "file" && res->type() != "dir") {
+			local = false;
+			continue;
+		}
+
+		// both local resource types store their location as CalendarURL
+		KConfig config(QString::null);
+		res->writeConfig(&config);
+		KURL url(config.readPathEntry("CalendarURL"));
+		if (url.isLocalFile())
+			paths.append(url.path());
+		else
+			local = false;
+	}
+	return local;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Start recording a journal with the resources of the loaded calendar and their configuration */
+void KCalSharedResource::begin_journal(ChangeJournal &journal) const
+{
+	journal.begin(loadTime);
+
+	QStringList paths;
+	if (!resource_paths(paths))
+		journal.invalidate();
+	paths.append(locateLocal("config", "kresources/calendar/stdrc"));
+	journal.recordPaths(paths);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Forget the loaded calendar without saving, so that the next load() reads it again */
+void KCalSharedResource::unload()
+{
 	delete calendar;
 	calendar = 0;
-	return true;
 }
 
 //--------------------------------------------------------------------------------
 
-static QString calc_hash(const KCal::Incidence *e)
+/** Save the calendar right away; only once its files are on disk the commit
+ * journals of both sinks are dropped
+ */
+bool KCalSharedResource::save()
+{
+	if (!calendar)
+		return true;
+
+	bool ok = write();
+	written(ok);
+	return ok;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Save the calendar and sync its files, see BackgroundSave */
+bool KCalSharedResource::write()
+{
+	// CalendarResources::save() doesn't tell about failures
+	bool ok = true;
+	KCal::CalendarResourceManager *manager = calendar->resourceManager();
+	for (KCal::CalendarResourceManager::ActiveIterator it = manager->activeBegin(); it != manager->activeEnd(); ++it) {
+		if (!(*it)->save())
+			ok = false;
+	}
+	if (!ok)
+		return false;
+	calendar->setModified(false);
+	modified = false;
+
+	QStringList paths;
+	resource_paths(paths);
+	return CommitJournal::syncFiles(paths);
+}
+
+//--------------------------------------------------------------------------------
+
+void KCalSharedResource::written(bool ok)
 {
-	QDateTime d = e->lastModified();
-	if (!d.isValid()) {
-		// if no modification date is available, always return the same 0-time stamp
-		// to avoid that 2 calls deliver different times which would be treated as changed entry
-		d.setTime_t(0);
+	if (!ok) {
+		osync_trace(TRACE_INTERNAL, "Unable to save the calendar, the commit journals are kept");
+		return;
 	}
-	return d.toString(Qt::ISODate);
+
+	if (eventSource)
+		eventSource->store_saved();
+	if (todoSource)
+		todoSource->store_saved();
+}
+
+//--------------------------------------------------------------------------------
+
+/** Returns false if ctx is reported later, by the save in the background */
+bool KCalSharedResource::close(OSyncContext *ctx)
+{
+	if (--refcount > 0)
+		return true;
+
+	prefetch.cancel();
+
+	bool saving = false;
+	if (calendar) {
+		/* Save the changes; saving rewrites the files, which would look like a change next time.
+		 * A child writes them while the remaining sinks go on, the calendar is dropped here. */
+		if (modified) {
+			BackgroundSave::start(*this, ctx);
+			saving = true;
+			calendar->setModified(false);
+			modified = false;
+			profile.mark("save");
+		}
+		unload();
+	}
+
+	profile.mark("close");
+	profile.report();
+	return !saving;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Leave out the parts of an incidence which the peer can not store */
+static void prune(const OSyncDataSource *dsobj, KCal::Incidence *e)
+{
+	if (!dsobj->peer_supports("Attach"))
+		e->clearAttachments();
+	if (!dsobj->peer_supports("Attendee"))
+		e->clearAttendees();
+	if (!dsobj->peer_supports("Alarm"))
+		e->clearAlarms();
+}
+
+//--------------------------------------------------------------------------------
+
+/** Take the pruned parts over from the stored incidence, as the peer never saw them */
+static void restore_pruned(const OSyncDataSource *dsobj, KCal::Incidence *e, const KCal::Incidence *old)
+{
+	if (!dsobj->peer_supports("Attach")) {
+		KCal::Attachment::List attachments = old->attachments();
+		for (KCal::Attachment::List::ConstIterator it = attachments.begin(); it != attachments.end(); ++it)
+			e->addAttachment(new KCal::Attachment(**it));
+	}
+	if (!dsobj->peer_supports("Attendee")) {
+		KCal::Attendee::List attendees = old->attendees();
+		for (KCal::Attendee::List::ConstIterator it = attendees.begin(); it != attendees.end(); ++it)
+			e->addAttendee(new KCal::Attendee(**it));
+	}
+	if (!dsobj->peer_supports("Alarm")) {
+		KCal::Alarm::List alarms = old->alarms();
+		for (KCal::Alarm::List::ConstIterator it = alarms.begin(); it != alarms.end(); ++it) {
+			KCal::Alarm *alarm = new KCal::Alarm(**it);
+			alarm->setParent(e);
+			e->addAlarm(alarm);
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+/** Serialize a single incidence to an iCalendar string */
+QCString KCalSharedResource::serialize(const OSyncDataSource *dsobj, const KCal::Incidence *e) const
+{
+	KCal::Incidence *copy = e->clone();
+	if (dsobj->prunes())
+		prune(dsobj, copy);
+
+	/* Build a local calendar for the incidence data */
+	KCal::CalendarLocal cal(calendar->timeZoneId());
+	cal.addIncidence(copy);
+
+	/* Convert the data to vcalendar */
+	KCal::ICalFormat format;
+	return format.toString(&cal).utf8();
+}
+
+//--------------------------------------------------------------------------------
+
+/** The hash combines the modification date with the content of the serialized
+ * incidence. The DTSTAMP property is left out, as ICalFormat sets it to the time
+ * of serialization.
+ */
+static QString calc_hash(const KCal::Incidence *e, const QCString &data)
+{
+	QCString canonical = data;
+	OSyncDataSource::remove_property(canonical, "\nDTSTAMP");
+
+	return OSyncDataSource::fingerprint(e->lastModified(), canonical.data(), canonical.length());
+}
+
+//--------------------------------------------------------------------------------
+
+/** The content of a serialized incidence, without the bookkeeping which every
+ * modification or serialization changes
+ */
+static QCString content_of(const QCString &data)
+{
+	QCString content = data;
+	OSyncDataSource::remove_property(content, "\nDTSTAMP");
+	OSyncDataSource::remove_property(content, "\nCREATED");
+	OSyncDataSource::remove_property(content, "\nLAST-MODIFIED");
+	OSyncDataSource::remove_property(content, "\nSEQUENCE");
+	return content;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Take over the plain fields which differ; each setter notifies the calendar */
+static void patch_fields(KCal::Incidence *stored, const KCal::Incidence *e)
+{
+	if (stored->summary() != e->summary())
+		stored->setSummary(e->summary());
+	if (stored->description() != e->description())
+		stored->setDescription(e->description());
+	if (stored->location() != e->location())
+		stored->setLocation(e->location());
+	if (stored->categories() != e->categories())
+		stored->setCategories(e->categories());
+	if (stored->priority() != e->priority())
+		stored->setPriority(e->priority());
+	if (stored->secrecy() != e->secrecy())
+		stored->setSecrecy(e->secrecy());
+}
+
+//--------------------------------------------------------------------------------
+
+/** Apply a modified incidence to the stored one in place. Nothing is touched if
+ * they have the same content, and only the plain fields are set if nothing else
+ * differs. Returns false if the stored incidence has to be replaced as a whole.
+ */
+bool KCalSharedResource::patch(const OSyncDataSource *dsobj, KCal::Incidence *stored, const KCal::Incidence *e)
+{
+	QCString incoming = content_of(serialize(dsobj, e));
+	if (content_of(serialize(dsobj, stored)) == incoming) {
+		osync_trace(TRACE_INTERNAL, "%s: unchanged", (const char *) stored->uid().utf8());
+		return true;
+	}
+
+	// try on a copy first, the calendar should only see a patch which is complete
+	KCal::Incidence *copy = stored->clone();
+	patch_fields(copy, e);
+	bool plain = (content_of(serialize(dsobj, copy)) == incoming);
+	delete copy;
+	if (!plain)
+		return false;
+
+	patch_fields(stored, e);
+	modified = true;
+	osync_trace(TRACE_INTERNAL, "%s: patched", (const char *) stored->uid().utf8());
+	return true;
 }
 
 //--------------------------------------------------------------------------------
@@ -89,15 +406,22 @@ static QString calc_hash(const KCal::Incidence *e)
  */
 bool KCalSharedResource::commit(OSyncDataSource *dsobj, OSyncContext *ctx, OSyncChange *chg)
 {
+	if (!load(ctx))
+		return false;
+
 	OSyncChangeType type = osync_change_get_changetype(chg);
 	switch (type) {
 		case OSYNC_CHANGE_TYPE_DELETED: {
 			KCal::Incidence *e = calendar->incidence(QString::fromUtf8(osync_change_get_uid(chg)));
 			if (!e) {
+				// a replayed delete might have reached the calendar before the crash
+				if (!ctx)
+					return true;
 				osync_context_report_error(ctx, OSYNC_ERROR_FILE_NOT_FOUND, "Event not found while deleting");
 				return false;
 			}
 			calendar->deleteIncidence(e);
+			modified = true;
 			break;
 		}
 		case OSYNC_CHANGE_TYPE_ADDED:
@@ -119,14 +443,13 @@ bool KCalSharedResource::commit(OSyncDataSource *dsobj, OSyncContext *ctx, OSync
 			KCal::CalendarLocal cal(QString::fromLatin1( "UTC" ));
 			QString data = QString::fromUtf8(databuf, databuf_size);
 			if (!format.fromString(&cal, data)) {
-				osync_context_report_error(ctx, OSYNC_ERROR_CONVERT, "Couldn't import calendar data");
+				if (ctx)
+					osync_context_report_error(ctx, OSYNC_ERROR_CONVERT, "Couldn't import calendar data");
 				return false;
 			}
 
+			// deleted only when the new one is added, it might still provide pruned fields
 			KCal::Incidence *oldevt = calendar->incidence(QString::fromUtf8(osync_change_get_uid(chg)));
-			if (oldevt) {
-				calendar->deleteIncidence(oldevt);
-                        }
 
 			/* Add the events from the temporary calendar, setting the UID
 				*
@@ -138,6 +461,9 @@ bool KCalSharedResource::commit(OSyncDataSource *dsobj, OSyncContext *ctx, OSync
 				if (type == OSYNC_CHANGE_TYPE_MODIFIED)
 					e->setUid(QString::fromUtf8(osync_change_get_uid(chg)));
 
+				if (oldevt && type == OSYNC_CHANGE_TYPE_MODIFIED && dsobj->prunes())
+					restore_pruned(dsobj, e, oldevt);
+
 				// if we run with a configured category filter, but the received added incidence does
 				// not contain that category, add the filter-categories so that the incidence will be
 				// found again on the next sync
@@ -152,14 +478,39 @@ bool KCalSharedResource::commit(OSyncDataSource *dsobj, OSyncContext *ctx, OSync
 				}
 
 				osync_change_set_uid(chg, e->uid().utf8());
-				QString hash = calc_hash(*i);
-				osync_change_set_hash(chg, hash.utf8());
+
+				// a modification only changes what differs, see patch()
+				if (oldevt && type == OSYNC_CHANGE_TYPE_MODIFIED && oldevt->type() == e->type() &&
+				    patch(dsobj, oldevt, e)) {
+					delete e;
+					QCString stored = serialize(dsobj, oldevt);
+					osync_change_set_hash(chg, calc_hash(oldevt, stored).utf8());
+					dsobj->record_echo(oldevt->uid().utf8(), stored);
+					oldevt = 0;
+					continue;
+				}
+
+				if (oldevt) {
+					calendar->deleteIncidence(oldevt);
+					oldevt = 0;
+				}
 				calendar->addIncidence(e);
+				modified = true;
+
+				// hash what is stored now, so it is recognized on the next sync
+				QCString stored = serialize(dsobj, e);
+				osync_change_set_hash(chg, calc_hash(e, stored).utf8());
+				dsobj->record_echo(e->uid().utf8(), stored);
+			}
+			if (oldevt) {
+				calendar->deleteIncidence(oldevt);
+				modified = true;
 			}
 			break;
 		}
 		default: {
-			osync_context_report_error(ctx, OSYNC_ERROR_NOT_SUPPORTED, "Invalid or unsupported change type");
+			if (ctx)
+				osync_context_report_error(ctx, OSYNC_ERROR_NOT_SUPPORTED, "Invalid or unsupported change type");
 			return false;
 		}
 	}
@@ -169,36 +520,52 @@ bool KCalSharedResource::commit(OSyncDataSource *dsobj, OSyncContext *ctx, OSync
 
 //--------------------------------------------------------------------------------
 
-/** Report a list of calendar incidences (events or to-dos), with the
- * right objtype and objformat.
+/** With xmlformat-event or xmlformat-todo, the fields of the incidence being
+ * enumerated go to the framework right away, instead of as iCalendar data which
+ * it parses into the same fields again. Prefetched and held back items only
+ * exist as text, they go as their iCalendar data, as does an incidence with
+ * fields which XMLConvert does not map.
+ */
+OSyncData *KCalSharedResource::make_data(OSyncDataSource *dsobj, const char *data, unsigned int size,
+                                         OSyncObjFormat *objformat, OSyncError **error)
+{
+	const char *name = osync_objformat_get_name(objformat);
+	if (!data || (strcmp(name, XMLFORMAT_EVENT) != 0 && strcmp(name, XMLFORMAT_TODO) != 0))
+		return dsobj->OSyncDataSource::make_data(data, size, objformat, error);
+
+	// anything pruned for the peer is not covered, so the incidence need not be pruned;
+	// the calendar is loaded in UTC, the times need no time zone then
+	if (!visited || !XMLConvert::covers(visited))
+		return dsobj->OSyncDataSource::make_data(data, size, dsobj->textFormat, error);
+
+	OSyncXMLFormat *xmlformat = XMLConvert::fromIncidence(dsobj->objtype, visited, error);
+	return xmlformat ? XMLConvert::toData(xmlformat, objformat, error) : 0;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Visit a single calendar incidence (event or to-do) as iCalendar data.
  *
  * This function exists because the logic for converting the events or to-dos
  * is the same, only the objtype and format is different.
  */
-bool KCalSharedResource::report_incidence(OSyncDataSource *dsobj,
-                                          OSyncObjTypeSink *sink,
-                                          OSyncPluginInfo *info, OSyncContext *ctx,
-                                          KCal::Incidence *e, OSyncObjFormat *objformat)
+bool KCalSharedResource::visit_incidence(const OSyncDataSource *dsobj, KCal::Incidence *e, ItemVisitor &visitor)
 {
-	/* Build a local calendar for the incidence data */
-	KCal::CalendarLocal cal(calendar->timeZoneId());
-	cal.addIncidence(e->clone());
+	QCString data = serialize(dsobj, e);
 
-	/* Convert the data to vcalendar */
-	KCal::ICalFormat format;
-	QString data = format.toString(&cal);
-
-	return dsobj->report_change(sink, info, ctx, e->uid(), data, calc_hash(e), objformat);
+	visited = e;
+	bool ok = visitor.item(e->uid(), data.data(), data.length(), calc_hash(e, data));
+	visited = 0;
+	return ok;
 }
 
 //--------------------------------------------------------------------------------
 
-bool KCalSharedResource::get_event_changes(OSyncDataSource *dsobj, OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx)
+/** Visit all events which match the category filter of dsobj, the calendar must be loaded */
+bool KCalSharedResource::enumerate_events(const OSyncDataSource *dsobj, ItemVisitor &visitor)
 {
-	OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
-	OSyncObjFormat *objformat = osync_format_env_find_objformat(formatenv, "vevent20");
-
-	KCal::Event::List events = calendar->events();
+	// unsorted, sorting would only cost another pass over the list
+	KCal::Event::List events = calendar->rawEvents();
 
 	for (KCal::Event::List::ConstIterator i = events.begin(); i != events.end(); i++) {
 
@@ -212,7 +579,7 @@ bool KCalSharedResource::get_event_changes(OSyncDataSource *dsobj, OSyncObjTypeS
 		if ( (*i)->uid().contains("KABC_Birthday") || (*i)->uid().contains("KABC_Anniversary") )
 			continue;
 
-		if (!report_incidence(dsobj, sink, info, ctx, *i, objformat))
+		if (!visit_incidence(dsobj, *i, visitor))
 			return false;
 	}
 
@@ -221,18 +588,16 @@ bool KCalSharedResource::get_event_changes(OSyncDataSource *dsobj, OSyncObjTypeS
 
 //--------------------------------------------------------------------------------
 
-bool KCalSharedResource::get_todo_changes(OSyncDataSource *dsobj, OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx)
+/** Visit all to-dos which match the category filter of dsobj, the calendar must be loaded */
+bool KCalSharedResource::enumerate_todos(const OSyncDataSource *dsobj, ItemVisitor &visitor)
 {
-	OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
-	OSyncObjFormat *objformat = osync_format_env_find_objformat(formatenv, "vtodo20");
-
-	KCal::Todo::List todos = calendar->todos();
+	KCal::Todo::List todos = calendar->rawTodos();
 
 	for (KCal::Todo::List::ConstIterator i = todos.begin(); i != todos.end(); i++) {
 		if ( ! dsobj->has_category((*i)->categories()) )
 			continue;
 
-		if (!report_incidence(dsobj, sink, info, ctx, *i, objformat))
+		if (!visit_incidence(dsobj, *i, visitor))
 			return false;
 	}
 
@@ -243,16 +608,32 @@ bool KCalSharedResource::get_todo_changes(OSyncDataSource *dsobj, OSyncObjTypeSi
 
 void KCalEventDataSource::connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx)
 {
-	if (kcal->open(ctx))
-          OSyncDataSource::connect(sink, info, ctx);
+	// profile the calendar shared with the other sink as well
+	if (profile.isEnabled())
+		kcal->memProfile().enable("calendar", QFile::decodeName(osync_plugin_info_get_configdir(info)) + "/calendar_memprofile");
+
+	if (kcal->open(ctx)) {
+		// replays the commit journal of an interrupted sync, before anything is read
+		OSyncDataSource::connect(sink, info, ctx);
+		if (want_prefetch(info))
+			kcal->start_prefetch();
+	}
 }
 
 //--------------------------------------------------------------------------------
 
 void KCalTodoDataSource::connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx)
 {
-	if (kcal->open(ctx))
+	// profile the calendar shared with the other sink as well
+	if (profile.isEnabled())
+		kcal->memProfile().enable("calendar", QFile::decodeName(osync_plugin_info_get_configdir(info)) + "/calendar_memprofile");
+
+	if (kcal->open(ctx)) {
+		// replays the commit journal of an interrupted sync, before anything is read
 		OSyncDataSource::connect(sink, info, ctx);
+		if (want_prefetch(info))
+			kcal->start_prefetch();
+	}
 }
 
 //--------------------------------------------------------------------------------
@@ -289,15 +670,34 @@ void KCalEventDataSource::get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *i
 		}
 	}
 
-	if (!kcal->get_event_changes(this, sink, info, ctx)) {
+	OSyncObjFormat *objformat = report_format(info, XMLFORMAT_EVENT, "vevent20");
+
+	ChangeJournal previous;
+	bool havePrevious = take_journal(info, slow_sync, previous);
+
+	ReportVisitor reporter(this, sink, info, ctx, objformat);
+	bool done = havePrevious && report_unchanged(previous, reporter);
+	bool ok = true;
+	if (!done)
+		ok = get_prefetched_items(kcal->prefetched(), KCalSharedResource::EventPart, reporter, done);
+	if (ok && !done)
+		ok = get_helper_items(reporter, done);
+	if (ok && !done) {
+		if (!kcal->load(ctx)) {
+			osync_trace(TRACE_EXIT_ERROR, "%s: Unable to load calendar", __PRETTY_FUNCTION__);
+			return;
+		}
+		kcal->begin_journal(journal);
+		JournalVisitor recorder(reporter, journal);
+		ok = kcal->enumerate_events(this, recorder);
+	}
+
+	if (!ok) {
 		osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Error while reciving latest changes.");
-		osync_trace(TRACE_EXIT_ERROR, "%s: error in get_todo_changes", __PRETTY_FUNCTION__);
+		osync_trace(TRACE_EXIT_ERROR, "%s: error in enumerate_events", __PRETTY_FUNCTION__);
 		return;
 	}
 
-	OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
-	OSyncObjFormat *objformat = osync_format_env_find_objformat(formatenv, "vevent20");
-
 	if (!report_deleted(sink, info, ctx, objformat)) {
 		osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Error while detecting latest changes.");
 		osync_trace(TRACE_EXIT_ERROR, "%s", __PRETTY_FUNCTION__);
@@ -316,8 +716,7 @@ void KCalTodoDataSource::get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *in
 
 	OSyncError *error = NULL;
 
-	OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
-	OSyncObjFormat *objformat = osync_format_env_find_objformat(formatenv, "vtodo20");
+	OSyncObjFormat *objformat = report_format(info, XMLFORMAT_TODO, "vtodo20");
 	OSyncHashTable *hashtable = osync_objtype_sink_get_hashtable(sink);
 
 	if (slow_sync) {
@@ -330,8 +729,28 @@ void KCalTodoDataSource::get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *in
 
 	}
 
-	if (!kcal->get_todo_changes(this, sink, info, ctx)) {
-		osync_trace(TRACE_EXIT_ERROR, "%s: error in get_todo_changes", __PRETTY_FUNCTION__);
+	ChangeJournal previous;
+	bool havePrevious = take_journal(info, slow_sync, previous);
+
+	ReportVisitor reporter(this, sink, info, ctx, objformat);
+	bool done = havePrevious && report_unchanged(previous, reporter);
+	bool ok = true;
+	if (!done)
+		ok = get_prefetched_items(kcal->prefetched(), KCalSharedResource::TodoPart, reporter, done);
+	if (ok && !done)
+		ok = get_helper_items(reporter, done);
+	if (ok && !done) {
+		if (!kcal->load(ctx)) {
+			osync_trace(TRACE_EXIT_ERROR, "%s: Unable to load calendar", __PRETTY_FUNCTION__);
+			return;
+		}
+		kcal->begin_journal(journal);
+		JournalVisitor recorder(reporter, journal);
+		ok = kcal->enumerate_todos(this, recorder);
+	}
+
+	if (!ok) {
+		osync_trace(TRACE_EXIT_ERROR, "%s: error in enumerate_todos", __PRETTY_FUNCTION__);
 		osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Error while detecting latest changes.");
 		return;
 	}
@@ -348,28 +767,117 @@ void KCalTodoDataSource::get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *in
 
 //--------------------------------------------------------------------------------
 
-void KCalEventDataSource::commit(OSyncObjTypeSink *sink, OSyncPluginInfo *, OSyncContext *ctx, OSyncChange *chg)
+void KCalEventDataSource::commit(OSyncObjTypeSink *, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *chg)
 {
+	if (!convert_received(info, ctx, chg, "vevent20", 0))
+		return;
+
 	// We use the same function for events and to-do
 	if (!kcal->commit(this, ctx, chg))
 		return;
 
-	OSyncHashTable *hashtable = osync_objtype_sink_get_hashtable(sink);
-	osync_hashtable_update_change(hashtable, chg);
+	// without a journal entry the hashtable must not learn about it, see flush_hash_updates()
+	if (!commits.append(chg)) {
+		osync_context_report_error(ctx, OSYNC_ERROR_IO_ERROR, "Unable to record the commit in the journal");
+		return;
+	}
+	defer_hash_update(chg);
 	osync_context_report_success(ctx);
 }
 
 //--------------------------------------------------------------------------------
 
-void KCalTodoDataSource::commit(OSyncObjTypeSink *sink, OSyncPluginInfo *, OSyncContext *ctx, OSyncChange *chg)
+bool KCalEventDataSource::apply_change(OSyncContext *ctx, OSyncChange *chg)
+{
+	return kcal->commit(this, ctx, chg);
+}
+
+//--------------------------------------------------------------------------------
+
+bool KCalEventDataSource::save_store(OSyncContext *)
+{
+	return kcal->save();
+}
+
+//--------------------------------------------------------------------------------
+
+QString KCalEventDataSource::content_fingerprint(const char *data, unsigned int size) const
+{
+	return fingerprint(content_of(QCString(data, size + 1)));
+}
+
+//--------------------------------------------------------------------------------
+
+OSyncData *KCalEventDataSource::make_data(const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error)
+{
+	return kcal->make_data(this, data, size, objformat, error);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Upcoming events first */
+int KCalEventDataSource::change_rank(const char *data, unsigned int size) const
+{
+	return rank_of_date(property_date(data, size, "\nDTSTART"), true);
+}
+
+//--------------------------------------------------------------------------------
+
+void KCalTodoDataSource::commit(OSyncObjTypeSink *, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *chg)
 {
+	if (!convert_received(info, ctx, chg, "vtodo20", 0))
+		return;
+
 	// We use the same function for calendar and to-do
 	if (!kcal->commit(this, ctx, chg))
 		return;
 
-	OSyncHashTable *hashtable = osync_objtype_sink_get_hashtable(sink);
-	osync_hashtable_update_change(hashtable, chg);
+	// without a journal entry the hashtable must not learn about it, see flush_hash_updates()
+	if (!commits.append(chg)) {
+		osync_context_report_error(ctx, OSYNC_ERROR_IO_ERROR, "Unable to record the commit in the journal");
+		return;
+	}
+	defer_hash_update(chg);
 	osync_context_report_success(ctx);
 }
 
 //--------------------------------------------------------------------------------
+
+bool KCalTodoDataSource::apply_change(OSyncContext *ctx, OSyncChange *chg)
+{
+	return kcal->commit(this, ctx, chg);
+}
+
+//--------------------------------------------------------------------------------
+
+bool KCalTodoDataSource::save_store(OSyncContext *)
+{
+	return kcal->save();
+}
+
+//--------------------------------------------------------------------------------
+
+QString KCalTodoDataSource::content_fingerprint(const char *data, unsigned int size) const
+{
+	return fingerprint(content_of(QCString(data, size + 1)));
+}
+
+//--------------------------------------------------------------------------------
+
+OSyncData *KCalTodoDataSource::make_data(const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error)
+{
+	return kcal->make_data(this, data, size, objformat, error);
+}
+
+//--------------------------------------------------------------------------------
+
+/** The to-dos which are due next first */
+int KCalTodoDataSource::change_rank(const char *data, unsigned int size) const
+{
+	QDate date = property_date(data, size, "\nDUE");
+	if (!date.isValid())
+		date = property_date(data, size, "\nDTSTART");
+	return rank_of_date(date, true);
+}
+
+//--------------------------------------------------------------------------------
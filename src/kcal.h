@@ -28,23 +28,50 @@ SOFTWARE IS DISCLAIMED.
 #include <libkcal/incidence.h>
 
 #include "datasource.h"
+#include "prefetch.h"
+#include "backgroundsave.h"
 
-class KCalSharedResource
+class KCalSharedResource : public Prefetch::Producer, public BackgroundSave::Writer
 {
 	public:
-		KCalSharedResource() : calendar(0), refcount(0) { }
+		enum { EventPart = 0, TodoPart = 1 };  // parts written by produce()
+
+		KCalSharedResource()
+			: calendar(0), refcount(0), modified(false), loadTime(0), visited(0), eventSource(0), todoSource(0) { }
 		bool open(OSyncContext *ctx);
 		bool close(OSyncContext *ctx);
-		bool get_event_changes(OSyncDataSource *dsobj, OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
-		bool get_todo_changes(OSyncDataSource *dsobj, OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
+		bool load(OSyncContext *ctx);
+		bool save();
+		void unload();
+		bool resource_paths(QStringList &paths) const;
+		void begin_journal(ChangeJournal &journal) const;
+		bool enumerate_events(const OSyncDataSource *dsobj, ItemVisitor &visitor);
+		bool enumerate_todos(const OSyncDataSource *dsobj, ItemVisitor &visitor);
 		bool commit(OSyncDataSource *dsobj, OSyncContext *ctx, OSyncChange *chg);
+		OSyncData *make_data(OSyncDataSource *dsobj, const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error);
+
+		void attach(OSyncDataSource *dsobj);
+		void start_prefetch();
+		Prefetch &prefetched() { return prefetch; }
+		MemProfile &memProfile() { return profile; }
+		virtual bool produce(int fd);
+		virtual bool write();
+		virtual void written(bool ok);
 
 	private:
-		KCal::CalendarResources *calendar;
+		KCal::CalendarResources *calendar;  // 0 until load()
 		int refcount;
+		bool modified;  // something was committed, save on close
+		Q_INT64 loadTime;  // when loading started, see ChangeJournal
+		const KCal::Incidence *visited;  // the incidence being reported, see make_data()
+		OSyncDataSource *eventSource;
+		OSyncDataSource *todoSource;
+		Prefetch prefetch;
+		MemProfile profile;  // open, load and close of the shared calendar
 
-		bool report_incidence(OSyncDataSource *dsobj, OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx,
-                                      KCal::Incidence *e, OSyncObjFormat *objformat);
+		bool visit_incidence(const OSyncDataSource *dsobj, KCal::Incidence *e, ItemVisitor &visitor);
+		QCString serialize(const OSyncDataSource *dsobj, const KCal::Incidence *e) const;
+		bool patch(const OSyncDataSource *dsobj, KCal::Incidence *stored, const KCal::Incidence *e);
 };
 
 //--------------------------------------------------------------------------------
@@ -52,13 +79,18 @@ class KCalSharedResource
 class KCalEventDataSource : public OSyncDataSource
 {
 	public:
-		KCalEventDataSource(KCalSharedResource *kcal) : OSyncDataSource("event"), kcal(kcal) {};
+		KCalEventDataSource(KCalSharedResource *kcal) : OSyncDataSource("event"), kcal(kcal) { kcal->attach(this); }
 		virtual ~KCalEventDataSource() {};
 
 		virtual void connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
 		virtual void disconnect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
 		virtual void get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync);
 		virtual void commit(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *chg);
+		virtual bool apply_change(OSyncContext *ctx, OSyncChange *chg);
+		virtual bool save_store(OSyncContext *ctx);
+		virtual QString content_fingerprint(const char *data, unsigned int size) const;
+		virtual int change_rank(const char *data, unsigned int size) const;
+		virtual OSyncData *make_data(const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error);
 
 	private:
 		KCalSharedResource *kcal;
@@ -69,13 +101,18 @@ class KCalEventDataSource : public OSyncDataSource
 class KCalTodoDataSource : public OSyncDataSource
 {
 	public:
-		KCalTodoDataSource(KCalSharedResource *kcal) : OSyncDataSource("todo"), kcal(kcal) {};
+		KCalTodoDataSource(KCalSharedResource *kcal) : OSyncDataSource("todo"), kcal(kcal) { kcal->attach(this); }
 		virtual ~KCalTodoDataSource() {};
 
 		virtual void connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
 		virtual void disconnect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
 		virtual void get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync);
 		virtual void commit(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *chg);
+		virtual bool apply_change(OSyncContext *ctx, OSyncChange *chg);
+		virtual bool save_store(OSyncContext *ctx);
+		virtual QString content_fingerprint(const char *data, unsigned int size) const;
+		virtual int change_rank(const char *data, unsigned int size) const;
+		virtual OSyncData *make_data(const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error);
 
 	private:
 		KCalSharedResource *kcal;
@@ -0,0 +1,398 @@
+/***********************************************************************
+Sync helper for the OpenSync kdepim-sync plugin
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2 as
+published by the Free Software Foundation;
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+SOFTWARE IS DISCLAIMED.
+*************************************************************************/
+
+#include <kapplication.h>
+#include <kcmdlineargs.h>
+#include <kaboutdata.h>
+#include <kstandarddirs.h>
+#include <kglobal.h>
+#include <qsocketnotifier.h>
+#include <qdatastream.h>
+#include <qfileinfo.h>
+#include <qfile.h>
+
+#include "kdepim-sync-helper.h"
+#include "synchelper.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+
+// quit when no plugin asked for an hour
+static const int IDLE_TIMEOUT = 60 * 60 * 1000;
+// a plugin sends its request right after connecting
+static const int REQUEST_TIMEOUT = 10 * 1000;
+
+SyncHelperServer::SyncHelperServer()
+	: listenFd(-1), inotifyFd(-1), listenNotifier(0), inotifyNotifier(0),
+	  loaded(0), dirty(0), events(&kcal), todos(&kcal)
+{
+	QObject::connect(&idleTimer, SIGNAL(timeout()), kapp, SLOT(quit()));
+	idleTimer.start(IDLE_TIMEOUT, true);
+
+	inotifyFd = inotify_init();
+	if (inotifyFd >= 0) {
+		fcntl(inotifyFd, F_SETFL, O_NONBLOCK);
+		fcntl(inotifyFd, F_SETFD, FD_CLOEXEC);
+		inotifyNotifier = new QSocketNotifier(inotifyFd, QSocketNotifier::Read, this);
+		QObject::connect(inotifyNotifier, SIGNAL(activated(int)), this, SLOT(watchActivity()));
+	}
+	else
+		osync_trace(TRACE_INTERNAL, "inotify not available, nothing will be cached");
+}
+
+//--------------------------------------------------------------------------------
+
+SyncHelperServer::~SyncHelperServer()
+{
+	invalidate(Contacts);
+	invalidate(Calendar);
+
+	if (listenFd >= 0) {
+		::close(listenFd);
+		::unlink(QFile::encodeName(SyncHelper::socketPath()));
+	}
+	if (inotifyFd >= 0)
+		::close(inotifyFd);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Create the listening socket. Returns false if another helper is already serving it */
+bool SyncHelperServer::listen()
+{
+	QCString path = QFile::encodeName(SyncHelper::socketPath());
+
+	struct sockaddr_un addr;
+	if (path.length() >= sizeof(addr.sun_path))
+		return false;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.data());
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return false;
+
+	// a socket nobody accepts on is a leftover of a crashed helper
+	if (::connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+		::close(fd);
+		return false;
+	}
+	::unlink(path.data());
+
+	if (::bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || ::listen(fd, 5) < 0) {
+		::close(fd);
+		return false;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	listenFd = fd;
+	listenNotifier = new QSocketNotifier(listenFd, QSocketNotifier::Read, this);
+	QObject::connect(listenNotifier, SIGNAL(activated(int)), this, SLOT(acceptConnection()));
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+void SyncHelperServer::acceptConnection()
+{
+	int fd = ::accept(listenFd, 0, 0);
+	if (fd < 0)
+		return;
+
+	serve(fd);
+	::close(fd);
+
+	idleTimer.start(IDLE_TIMEOUT, true);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Answer one request; plugins are served one after the other */
+void SyncHelperServer::serve(int fd)
+{
+	QByteArray request;
+	if (!SyncHelper::readBlock(fd, request, REQUEST_TIMEOUT))
+		return;
+
+	Q_UINT32 version;
+	QString objtype;
+	QStringList categories;
+	QDataStream in(request, IO_ReadOnly);
+	in >> version >> objtype >> categories;
+
+	QString error;
+	int store = 0;
+	if (version != SyncHelper::PROTOCOL_VERSION)
+		error = "protocol version mismatch";
+	else if (objtype == "contact")
+		store = Contacts;
+	else if (objtype == "event" || objtype == "todo")
+		store = Calendar;
+	else
+		error = "unsupported objtype " + objtype;
+
+	QValueList<QByteArray> items;
+	bool cached = false;
+	if (store) {
+		// changes written right before this request are already queued; the
+		// cached items and the loaded store are from before them
+		drainWatches();
+		if (dirty & store)
+			invalidate(store);
+
+		QString key = objtype + '\n' + categories.join("\n");
+		QMap<QString, QValueList<QByteArray> >::ConstIterator it = cache.find(key);
+		if (it != cache.end()) {
+			items = *it;
+			cached = true;
+		}
+		else {
+			if (store == Contacts)
+				contacts.setCategories(categories);
+			else if (objtype == "event")
+				events.setCategories(categories);
+			else
+				todos.setCategories(categories);
+
+			if (!load(store))
+				error = "unable to load " + objtype;
+			else if (!(dirty & store)) {
+				CollectVisitor collector(items);
+				if (!enumerate(store, objtype, collector) || !collector.finish())
+					error = "unable to serialize " + objtype;
+				else {
+					cache.insert(key, items);
+					cached = true;
+				}
+			}
+		}
+	}
+
+	QByteArray status;
+	QDataStream out(status, IO_WriteOnly);
+	out << (Q_INT8) error.isEmpty() << error;
+
+	if (SyncHelper::writeBlock(fd, status) && error.isEmpty()) {
+		if (cached) {
+			for (QValueList<QByteArray>::ConstIterator c = items.begin(); c != items.end(); ++c)
+				if (!SyncHelper::writeBlock(fd, *c))
+					break;
+		}
+		else {
+			// nothing to keep, so the items go out while they are serialized;
+			// a failure leaves the connection without the end marker
+			CollectVisitor collector(fd);
+			if (enumerate(store, objtype, collector))
+				collector.finish();
+		}
+	}
+
+	// resources which can not be watched are read again next time
+	if (store && (dirty & store))
+		invalidate(store);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Load the store if it is not loaded yet */
+bool SyncHelperServer::load(int store)
+{
+	if (loaded & store)
+		return true;
+
+	bool ok = (store == Contacts) ? contacts.load(0, false) : kcal.load(0);
+	if (!ok)
+		return false;
+
+	loaded |= store;
+	watch(store);
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Serialize the items of objtype from the loaded store */
+bool SyncHelperServer::enumerate(int store, const QString &objtype, ItemVisitor &visitor)
+{
+	bool ok;
+	if (store == Contacts)
+		ok = contacts.enumerate(visitor);
+	else if (objtype == "event")
+		ok = kcal.enumerate_events(&events, visitor);
+	else
+		ok = kcal.enumerate_todos(&todos, visitor);
+
+	osync_trace(TRACE_INTERNAL, "serialized %s", (const char *) objtype.latin1());
+	return ok;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Watch the files and the configuration of a store which was just loaded */
+void SyncHelperServer::watch(int store)
+{
+	QStringList paths;
+	bool local;
+	if (store == Contacts) {
+		local = contacts.resource_paths(paths);
+		paths.append(KGlobal::dirs()->saveLocation("config", "kresources/contact/"));
+	}
+	else {
+		local = kcal.resource_paths(paths);
+		paths.append(KGlobal::dirs()->saveLocation("config", "kresources/calendar/"));
+	}
+
+	if (!local || inotifyFd < 0) {
+		dirty |= store;
+		return;
+	}
+
+	// files are replaced on save, so watch the directories containing them
+	const uint32_t mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF;
+	for (QStringList::ConstIterator it = paths.begin(); it != paths.end(); ++it) {
+		QFileInfo info(*it);
+		QString dir = info.isDir() ? info.absFilePath() : info.dirPath(true);
+
+		int wd = inotify_add_watch(inotifyFd, QFile::encodeName(dir), mask);
+		if (wd < 0) {
+			dirty |= store;
+			return;
+		}
+		// both stores might live in the same directory
+		watches[wd] |= store;
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+void SyncHelperServer::watchActivity()
+{
+	drainWatches();
+
+	if (dirty & Contacts)
+		invalidate(Contacts);
+	if (dirty & Calendar)
+		invalidate(Calendar);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Read all pending inotify events and mark the affected stores dirty */
+void SyncHelperServer::drainWatches()
+{
+	if (inotifyFd < 0)
+		return;
+
+	char buffer[4096];
+	ssize_t len;
+	while ((len = ::read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+		for (char *p = buffer; p < buffer + len; ) {
+			struct inotify_event *event = (struct inotify_event *) p;
+
+			if (event->mask & IN_Q_OVERFLOW)
+				dirty |= Contacts | Calendar;
+			else if (watches.contains(event->wd))
+				dirty |= watches[event->wd];
+
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+/** Drop the loaded resources, their watches and the serialized items of a store */
+void SyncHelperServer::invalidate(int store)
+{
+	if (loaded & store) {
+		osync_trace(TRACE_INTERNAL, "dropping store %d", store);
+		if (store == Contacts)
+			contacts.unload();
+		else
+			kcal.unload();
+	}
+	loaded &= ~store;
+	dirty &= ~store;
+
+	QMap<int, int>::Iterator w = watches.begin();
+	while (w != watches.end()) {
+		QMap<int, int>::Iterator next = w;
+		++next;
+		*w &= ~store;
+		if (!*w) {
+			inotify_rm_watch(inotifyFd, w.key());
+			watches.remove(w);
+		}
+		w = next;
+	}
+
+	QMap<QString, QValueList<QByteArray> >::Iterator c = cache.begin();
+	while (c != cache.end()) {
+		QMap<QString, QValueList<QByteArray> >::Iterator next = c;
+		++next;
+		bool contact = c.key().startsWith("contact\n");
+		if ((store == Contacts && contact) || (store == Calendar && !contact))
+			cache.remove(c);
+		c = next;
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+	KAboutData aboutData(
+	    "kdepim-sync-helper",                // internal program name
+	    "OpenSync-KDE3-sync-helper",         // displayable program name.
+	    "0.4",                               // version string
+	    "Keeps KDE PIM data loaded for the OpenSync kdepim plugin",  // short program description
+	    KAboutData::License_GPL,             // license type
+	    0,                                   // copyright statement: that of the plugin, see AUTHORS
+	    "Part of the OpenSync kdepim plugin",  // any free form text
+	    "http://www.opensync.org",           // program home page address
+	    "http://www.opensync.org/newticket"  // bug report email address
+	);
+
+	KCmdLineArgs::init(argc, argv, &aboutData);
+
+	// do not get killed with the session of the plugin which started us
+	setsid();
+	signal(SIGPIPE, SIG_IGN);
+
+	KApplication application(false, false);
+
+	SyncHelperServer server;
+	if (!server.listen())
+		return 1;
+
+	return application.exec();
+}
+
+#include "kdepim-sync-helper.moc"
@@ -0,0 +1,61 @@
+#ifndef KDEPIM_SYNC_HELPER_H
+#define KDEPIM_SYNC_HELPER_H
+
+#include <qobject.h>
+#include <qmap.h>
+#include <qtimer.h>
+
+#include "kaddrbook.h"
+#include "kcal.h"
+
+class QSocketNotifier;
+
+/* Serves the items of the addressbook and the calendar to the plugin, see
+ * synchelper.h for the protocol.
+ *
+ * The resources are loaded on the first request and kept, together with the
+ * serialized items per objtype and category filter. inotify watches on the
+ * resource files and the resource configuration drop them again when they change.
+ */
+class SyncHelperServer : public QObject
+{
+	Q_OBJECT
+
+	public:
+		SyncHelperServer();
+		virtual ~SyncHelperServer();
+
+		bool listen();
+
+	private slots:
+		void acceptConnection();
+		void watchActivity();
+
+	private:
+		enum Store { Contacts = 1, Calendar = 2 };
+
+		void serve(int fd);
+		bool load(int store);
+		bool enumerate(int store, const QString &objtype, ItemVisitor &visitor);
+		void watch(int store);
+		void drainWatches();
+		void invalidate(int store);
+
+		int listenFd;
+		int inotifyFd;
+		QSocketNotifier *listenNotifier;
+		QSocketNotifier *inotifyNotifier;
+		QTimer idleTimer;
+
+		QMap<int, int> watches;  // inotify watch descriptor -> Store
+		int loaded;  // Stores which are loaded
+		int dirty;  // Stores which changed since loading
+		QMap<QString, QValueList<QByteArray> > cache;  // objtype and categories -> item chunks
+
+		KContactDataSource contacts;
+		KCalSharedResource kcal;
+		KCalEventDataSource events;
+		KCalTodoDataSource todos;
+};
+
+#endif // KDEPIM_SYNC_HELPER_H
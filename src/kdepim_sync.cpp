@@ -33,8 +33,10 @@ SOFTWARE IS DISCLAIMED.
 #include "kaddrbook.h"
 #include "kcal.h"
 #include "knotes.h"
+#include "backgroundsave.h"
 
 #include <string.h>
+#include <stdlib.h>
 
 #include <opensync/opensync-plugin.h>
 #include <opensync/opensync-version.h>
@@ -42,7 +44,9 @@ SOFTWARE IS DISCLAIMED.
 class KdePluginImplementation
 {
 	public:
-		KdePluginImplementation() : application(0), newApplication(false)
+		KdePluginImplementation(OSyncPluginInfo *info)
+			: kaddrbook(0), kcal(0), kcal_event(0), kcal_todo(0), knotes(0),
+			  application(0), newApplication(false)
 		{
 			KAboutData aboutData(
 			    "libopensync-kdepim-plugin",         // internal program name
@@ -62,31 +66,49 @@ class KdePluginImplementation
 				application = kapp;
 				newApplication = false;
 			} else {
-				application = new KApplication( true, true );
+				// The plugin itself never shows a window, so unless there is a display
+				// to use, run without GUI: no X connection, styles or fonts are needed,
+				// while DCOP and KConfig work as usual
+				const char *display = getenv("DISPLAY");
+				bool gui = display && *display && !OSyncDataSource::get_advanced_option_bool(info, "Headless");
+				osync_trace(TRACE_INTERNAL, "starting %s KApplication", gui ? "GUI" : "non-GUI");
+
+				application = new KApplication( gui, gui );
 				newApplication = true;
 			}
-
-			kaddrbook  = new KContactDataSource();
-			kcal_event = new KCalEventDataSource(&kcal);
-			kcal_todo  = new KCalTodoDataSource(&kcal);
-			knotes     = new KNotesDataSource();
 		}
 
+		/* only create the data sources of the objtypes enabled in the group */
 		bool initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSyncError **error)
 		{
 			osync_trace(TRACE_ENTRY, "%s(%p, %p)", __PRETTY_FUNCTION__, plugin, info);
 
-			if (!kaddrbook->initialize(plugin, info, error))
-				goto error;
+			if (enabled(info, "contact")) {
+				kaddrbook = new KContactDataSource();
+				if (!kaddrbook->initialize(plugin, info, error))
+					goto error;
+			}
 
-			if (!kcal_event->initialize(plugin, info, error))
-				goto error;
+			if (enabled(info, "event") || enabled(info, "todo"))
+				kcal = new KCalSharedResource();
 
-			if (!kcal_todo->initialize(plugin, info, error))
-				goto error;
+			if (enabled(info, "event")) {
+				kcal_event = new KCalEventDataSource(kcal);
+				if (!kcal_event->initialize(plugin, info, error))
+					goto error;
+			}
+
+			if (enabled(info, "todo")) {
+				kcal_todo = new KCalTodoDataSource(kcal);
+				if (!kcal_todo->initialize(plugin, info, error))
+					goto error;
+			}
 
-			if (!knotes->initialize(plugin, info, error))
-				goto error;
+			if (enabled(info, "note")) {
+				knotes = new KNotesDataSource();
+				if (!knotes->initialize(plugin, info, error))
+					goto error;
+			}
 
 			osync_trace(TRACE_EXIT, "%s", __PRETTY_FUNCTION__);
 			return true;
@@ -102,6 +124,7 @@ class KdePluginImplementation
 			delete kcal_event;
 			delete kcal_todo;
 			delete knotes;
+			delete kcal;
 
 			if ( newApplication ) {
 				delete application;
@@ -109,8 +132,13 @@ class KdePluginImplementation
 			}
 		}
 	private:
+		static bool enabled(OSyncPluginInfo *info, const char *objtype)
+		{
+			return osync_plugin_info_find_objtype(info, objtype) != NULL;
+		}
+
 		KContactDataSource *kaddrbook;
-		KCalSharedResource kcal;
+		KCalSharedResource *kcal;
 		KCalEventDataSource *kcal_event;
 		KCalTodoDataSource *kcal_todo;
 		KNotesDataSource *knotes;
@@ -130,7 +158,7 @@ void *kde_initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSyncError **er
 {
 	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __func__, plugin, info, error);
 
-	KdePluginImplementation *impl_object = new KdePluginImplementation;
+	KdePluginImplementation *impl_object = new KdePluginImplementation(info);
 
 	if ( !impl_object->initialize(plugin, info, error) )
 		return 0;
@@ -178,6 +206,9 @@ void kde_finalize(void *userdata)
 {
 	osync_trace(TRACE_ENTRY, "%s(%p)", __func__, userdata);
 	KdePluginImplementation *impl_object = (KdePluginImplementation *)userdata;
+
+	// the writers belong to the data sources
+	BackgroundSave::reap(true);
 	delete impl_object;
 	osync_trace(TRACE_EXIT, "%s", __func__);
 }
@@ -31,8 +31,144 @@ SOFTWARE IS DISCLAIMED.
  */
 
 #include "knotes.h"
-/*An adapted C++ implementation of RSA Data Securities MD5 algorithm.*/
-#include <kmdcodec.h>
+#include "xmlconvert.h"
+#include "richtext.h"
+#include <libkcal/calendarlocal.h>
+#include <libkcal/journal.h>
+#include <qeventloop.h>
+#include <qfile.h>
+#include <string.h>
+
+/** how long to wait for all replies of a batched DCOP call */
+static const int BATCH_TIMEOUT = 60000;
+
+/** number of note texts fetched from KNotes and reported at a time */
+static const unsigned int TEXT_WINDOW = 64;
+
+/** how long to wait for a started KNotes to show up on DCOP */
+static const int STARTUP_TIMEOUT = 30000;
+
+/** how long to wait before looking for the DCOP objects of a registered KNotes again */
+static const int OBJECT_RETRY = 100;
+
+/** notes are handed to the framework as xml if the resource lists it, see make_data() */
+static const char XMLFORMAT_NOTE[] = "xmlformat-note";
+
+//--------------------------------------------------------------------------------
+
+bool KNotesBatchCall::call(const QCString &fun, const QValueList<KNoteID_t> &ids, const QCString &replyType, int msecs,
+                           const QString &app)
+{
+	replies.clear();
+	pending.clear();
+	expectedType = replyType;
+	failed = false;
+
+	for (QValueList<KNoteID_t>::ConstIterator it = ids.begin(); it != ids.end(); ++it) {
+		QByteArray data;
+		QDataStream arg(data, IO_WriteOnly);
+		if (!app.isNull())
+			arg << app;
+		arg << *it;
+
+		int callId = client->callAsync("knotes", "KNotesIface", fun, data,
+		                               this, SLOT(reply(int, const QCString&, const QByteArray&)));
+		if (!callId) {
+			osync_trace(TRACE_INTERNAL, "Unable to send %s for note %s", (const char *)fun, (const char *)(*it).utf8());
+			return false;
+		}
+		pending.insert(callId, *it);
+	}
+
+	QTimer timer;
+	QObject::connect(&timer, SIGNAL(timeout()), this, SLOT(timeout()));
+	timer.start(msecs, true);
+
+	while (!pending.isEmpty() && !failed)
+		qApp->eventLoop()->processEvents(QEventLoop::ExcludeUserInput | QEventLoop::WaitForMore);
+
+	return !failed;
+}
+
+//--------------------------------------------------------------------------------
+
+void KNotesBatchCall::reply(int callId, const QCString &replyType, const QByteArray &replyData)
+{
+	QMap<int, KNoteID_t>::Iterator it = pending.find(callId);
+	if (it == pending.end())
+		return;
+
+	if (replyType != expectedType) {
+		osync_trace(TRACE_INTERNAL, "Unexpected reply type %s for note %s", (const char *)replyType, (const char *)it.data().utf8());
+		failed = true;
+	}
+	else
+		replies.insert(it.data(), replyData);
+
+	pending.remove(it);
+}
+
+//--------------------------------------------------------------------------------
+
+void KNotesBatchCall::timeout()
+{
+	osync_trace(TRACE_INTERNAL, "Timeout with %d replies outstanding", pending.count());
+	failed = true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool KNotesStartup::wait(int msecs)
+{
+	// the DCOP server tells about every application which registers from now on
+	client->setNotifications(true);
+	QObject::connect(client, SIGNAL(applicationRegistered(const QCString&)), this, SLOT(registered(const QCString&)));
+	QObject::connect(&retry, SIGNAL(timeout()), this, SLOT(check()));
+
+	QTimer timer;
+	QObject::connect(&timer, SIGNAL(timeout()), this, SLOT(timeout()));
+	timer.start(msecs, true);
+
+	// it might have registered before the notifications were enabled
+	check();
+	while (!done)
+		qApp->eventLoop()->processEvents(QEventLoop::ExcludeUserInput | QEventLoop::WaitForMore);
+
+	QObject::disconnect(client, SIGNAL(applicationRegistered(const QCString&)), this, SLOT(registered(const QCString&)));
+	client->setNotifications(false);
+	return reachable;
+}
+
+//--------------------------------------------------------------------------------
+
+void KNotesStartup::registered(const QCString &appId)
+{
+	if (appId == "knotes")
+		check();
+}
+
+//--------------------------------------------------------------------------------
+
+void KNotesStartup::check()
+{
+	if (done || !client->isApplicationRegistered("knotes"))
+		return;
+
+	bool ok = false;
+	QCStringList objects = client->remoteObjects("knotes", &ok);
+	if (ok && objects.contains("KNotesIface"))
+		done = reachable = true;
+	else
+		retry.start(OBJECT_RETRY, true);
+}
+
+//--------------------------------------------------------------------------------
+
+void KNotesStartup::timeout()
+{
+	osync_trace(TRACE_INTERNAL, "Timeout waiting for knotes to register with DCOP");
+	done = true;
+}
 
 //--------------------------------------------------------------------------------
 
@@ -57,14 +193,17 @@ void KNotesDataSource::connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OS
 	QString appId = kn_dcop->registerAs("opensync");
 
 	//check knotes running
-	QCStringList apps = kn_dcop->registeredApplications();
-	if (!apps.contains("knotes")) {
-		//start knotes if not running
-		knotesWasRunning = false;
-		system("knotes");
-		system("dcop knotes KNotesIface hideAllNotes");
-	} else
-		knotesWasRunning = true;
+	// if it isn't, the notes are read from its storage and it is only started
+	// when changes have to be committed
+	knotesWasRunning = kn_dcop->isApplicationRegistered("knotes");
+	knotesStarted = false;
+	notesHidden = false;
+	failedCalls = 0;
+	nextMark = -1;
+
+	// KNotes keeps change flags per syncing application; every group member
+	// needs its own, so use the member's config directory to tell them apart
+	syncApp = "opensync-" + fingerprint(QCString(osync_plugin_info_get_configdir(info))).left(8);
 
 	kn_iface = new KNotesIface_stub("knotes", "KNotesIface");
 
@@ -79,10 +218,12 @@ void KNotesDataSource::disconnect(OSyncObjTypeSink *, OSyncPluginInfo *, OSyncCo
 {
 	osync_trace(TRACE_ENTRY, "%s(%p)", __func__, ctx);
 
-	// FIXME: ugly, but necessary
-	if (!knotesWasRunning) {
-		system("dcop knotes MainApplication-Interface quit");
+	// quit KNotes again if we started it
+	if (knotesStarted) {
+		if (!kn_dcop->send("knotes", "MainApplication-Interface", "quit()", QByteArray()))
+			osync_trace(TRACE_INTERNAL, "ERROR: Unable to quit knotes");
 	}
+	knotesStarted = false;
 
 	//detach dcop
 	/*if (!kn_dcop->detach()) {
@@ -102,25 +243,206 @@ void KNotesDataSource::disconnect(OSyncObjTypeSink *, OSyncPluginInfo *, OSyncCo
 
 //--------------------------------------------------------------------------------
 
-static QString strip_html(QString input)
+/** Start KNotes if it is not yet running; needed before changes can be committed */
+bool KNotesDataSource::startKNotes(OSyncContext *ctx)
 {
-	osync_trace(TRACE_SENSITIVE, "input is %s\n", (const char*)input.local8Bit());
-	QString output = NULL;
-	unsigned int i = 0;
-	int inbraces = 0;
-	for (i = 0; i < input.length(); i++) {
-		QCharRef cur = input[i];
-		if (cur == '<')
-			inbraces = 1;
-		if (cur == '>') {
-			inbraces = 0;
-			continue;
+	if (knotesWasRunning || knotesStarted)
+		return true;
+
+	osync_trace(TRACE_INTERNAL, "starting knotes");
+
+	// let klauncher start it; this returns as soon as the process is running
+	QString error;
+	if (KApplication::kdeinitExec("knotes", QStringList(), &error) != 0) {
+		osync_context_report_error(ctx, OSYNC_ERROR_INITIALIZATION, "Unable to start knotes: %s",
+		                           (const char *)error.local8Bit());
+		return false;
+	}
+
+	if (!waitForKNotes(STARTUP_TIMEOUT)) {
+		osync_context_report_error(ctx, OSYNC_ERROR_INITIALIZATION, "knotes did not register with DCOP");
+		return false;
+	}
+	knotesStarted = true;
+
+	kn_iface->hideAllNotes();
+	queued("hideAllNotes");
+	notesHidden = true;
+
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Wait until the KNotesIface object of a starting KNotes is reachable, see KNotesStartup */
+bool KNotesDataSource::waitForKNotes(int msecs)
+{
+	KNotesStartup startup(kn_dcop);
+	return startup.wait(msecs);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Read the notes directly from the KNotes storage. Only valid while KNotes is not
+ * running, as otherwise its in-memory state might be newer than the file.
+ */
+bool KNotesDataSource::readNotesFile(QMap<KNoteID_t,QString> &names, QMap<KNoteID_t,QString> &texts)
+{
+	QString fileName = KGlobal::dirs()->saveLocation("data", "knotes/") + "notes.ics";
+	osync_trace(TRACE_INTERNAL, "reading notes from %s", (const char *)QFile::encodeName(fileName));
+
+	if (!QFile::exists(fileName))
+		return true;  // no notes yet
+
+	KCal::CalendarLocal cal(QString::fromLatin1("UTC"));
+	if (!cal.load(fileName))
+		return false;
+
+	KCal::Journal::List journals = cal.journals();
+	for (KCal::Journal::List::ConstIterator it = journals.begin(); it != journals.end(); ++it) {
+		names.insert((*it)->uid(), (*it)->summary());
+		texts.insert((*it)->uid(), (*it)->description());
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** The name of one of the two marks which KNotes keeps for us, see get_changes();
+ * the first one is the name used before there were two.
+ */
+QString KNotesDataSource::markApp(int mark) const
+{
+	return mark ? syncApp + "-1" : syncApp;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Get the names of all notes and the ids of the notes whose texts are needed.
+ * Read from the storage file, the texts of all notes come along instead.
+ *
+ * If a hashtable is given, KNotes' own change tracking is used and texts are
+ * only needed for notes which KNotes flags as new or modified since it was
+ * marked as synced by app, or which are not yet known to the hashtable.
+ */
+bool KNotesDataSource::fetchNotes(QMap<KNoteID_t,QString> &names, QMap<KNoteID_t,QString> &texts,
+                                  QValueList<KNoteID_t> &changed, OSyncHashTable *hashtable, const QString &app)
+{
+	if (!knotesWasRunning && !knotesStarted)
+		return readNotesFile(names, texts);
+
+	names = kn_iface->notes();
+	if (kn_iface->status() != DCOPStub::CallSucceeded)
+		return false;
+
+	changed = names.keys();
+
+	if (hashtable) {
+		KNotesBatchCall modified(kn_dcop);
+		if (!modified.call("isModified(QString,QString)", changed, "bool", BATCH_TIMEOUT, app))
+			return false;
+
+		changed.clear();
+		for (QMap<KNoteID_t,QByteArray>::ConstIterator it = modified.replies.begin(); it != modified.replies.end(); ++it) {
+			QDataStream reply(it.data(), IO_ReadOnly);
+			Q_INT8 flag;
+			reply >> flag;
+			if (flag || !osync_hashtable_get_hash(hashtable, it.key().utf8()))
+				changed.append(it.key());
 		}
-		if (!inbraces)
-			output += input[i];
+		osync_trace(TRACE_INTERNAL, "%d of %d notes changed since the last sync", changed.count(), names.count());
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Get the texts of some notes with one batch of DCOP calls to the running KNotes */
+bool KNotesDataSource::fetchTexts(const QValueList<KNoteID_t> &ids, QMap<KNoteID_t,QString> &texts)
+{
+	KNotesBatchCall batch(kn_dcop);
+	if (!batch.call("text(QString)", ids, "QString", BATCH_TIMEOUT))
+		return false;
+
+	for (QMap<KNoteID_t,QByteArray>::ConstIterator it = batch.replies.begin(); it != batch.replies.end(); ++it) {
+		QDataStream reply(it.data(), IO_ReadOnly);
+		QString text;
+		reply >> text;
+		texts.insert(it.key(), text);
 	}
-	osync_trace(TRACE_SENSITIVE, "output is %s\n", (const char*)output.stripWhiteSpace().local8Bit());
-	return output.stripWhiteSpace();
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Report the notes of which the texts are known and forget the texts */
+bool KNotesDataSource::reportTexts(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx,
+                                   QMap<KNoteID_t,QString> &names, QMap<KNoteID_t,QString> &texts,
+                                   OSyncObjFormat *objformat)
+{
+	QMap<KNoteID_t,QString>::Iterator i;
+	for (i = texts.begin(); i != texts.end(); i++) {
+		osync_trace(TRACE_INTERNAL, "reporting notes %s\n", static_cast<const char*>(i.key().utf8()));
+
+		QString uid = i.key();
+		QString data = names[uid] + '\n' + strip_html(i.data());
+		QCString utf8 = data.utf8();
+		QString hash = fingerprint(utf8);
+
+		if ( !report_change(sink, info, ctx, uid, utf8.data(), utf8.length(), hash, objformat) )
+			return false;
+
+		// what is left in names at the end was not changed
+		names.remove(uid);
+	}
+	texts.clear();
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** With xmlformat-note, the name and text of a note become its Summary and
+ * Description right here, instead of being joined to a memo which the
+ * framework then parses into the same fields again.
+ */
+OSyncData *KNotesDataSource::make_data(const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error)
+{
+	if (strcmp(osync_objformat_get_name(objformat), XMLFORMAT_NOTE) != 0)
+		return OSyncDataSource::make_data(data, size, objformat, error);
+
+	QString memo = QString::fromUtf8(data, size);
+
+	OSyncXMLFormat *xmlformat = osync_xmlformat_new(objtype, error);
+	if (!xmlformat)
+		return 0;
+
+	if (!XMLConvert::addField(xmlformat, "Summary", memo.section('\n', 0, 0), error) ||
+	    !XMLConvert::addField(xmlformat, "Description", memo.section('\n', 1), error)) {
+		osync_xmlformat_unref(xmlformat);
+		return 0;
+	}
+	return XMLConvert::toData(xmlformat, objformat, error);
+}
+
+//--------------------------------------------------------------------------------
+
+/** Name and text of a note received as xmlformat-note, joined like a memo */
+static QString xmlformat_memo(OSyncData *odata)
+{
+	char *buf = 0;
+	unsigned int size = 0;
+	osync_data_get_data(odata, &buf, &size);
+	OSyncXMLFormat *xmlformat = reinterpret_cast<OSyncXMLFormat *>(buf);
+
+	QString summary, body;
+	for (OSyncXMLField *field = osync_xmlformat_get_first_field(xmlformat); field; field = osync_xmlfield_get_next(field)) {
+		const char *name = osync_xmlfield_get_name(field);
+		if (strcmp(name, "Summary") == 0)
+			summary = QString::fromUtf8(osync_xmlfield_get_key_value(field, "Content"));
+		else if (strcmp(name, "Description") == 0)
+			body = QString::fromUtf8(osync_xmlfield_get_key_value(field, "Content"));
+	}
+	return summary + '\n' + body;
 }
 
 //--------------------------------------------------------------------------------
@@ -129,16 +451,10 @@ void KNotesDataSource::get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info
 {
 	osync_trace(TRACE_ENTRY, "%s(%p)", __func__, ctx);
 	QMap <KNoteID_t,QString> fNotes;
-	KMD5 hash_value;
+	QMap <KNoteID_t,QString> fTexts;
+	QValueList<KNoteID_t> fChanged;
 	OSyncError *error = NULL;
 
-	fNotes = kn_iface->notes();
-	if (kn_iface->status() != DCOPStub::CallSucceeded) {
-		osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Unable to get changed notes");
-		osync_trace(TRACE_EXIT_ERROR, "%s: Unable to get changed notes", __func__);
-		return;
-	}
-
 	OSyncHashTable *hashtable = osync_objtype_sink_get_hashtable(sink);
 	if (slow_sync) {
 		osync_trace(TRACE_INTERNAL, "Got slow-sync, resetting hashtable");
@@ -149,25 +465,83 @@ void KNotesDataSource::get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info
 		}
 	}
 
-	OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
-	OSyncObjFormat *objformat = osync_format_env_find_objformat(formatenv, "memo");
+	// KNotes' change flags can only be trusted if the previous sync was completed
+	OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(sink);
+	osync_bool incremental = FALSE;
+	if (!slow_sync && (knotesWasRunning || knotesStarted) &&
+	    !osync_sink_state_equal(state_db, "knotes_synced", "true", &incremental, &error)) {
+		osync_context_report_osyncerror(ctx, error);
+		osync_trace(TRACE_EXIT_ERROR, "%s: %s", __PRETTY_FUNCTION__, osync_error_print(&error));
+		osync_error_unref(&error);
+		return;
+	}
+	osync_trace(TRACE_INTERNAL, "incremental note sync: %s", incremental ? "yes" : "no");
+
+	/* KNotes flags a note as modified if it differs from the mark which sync()
+	 * took for an application. Two marks are used in turn: the one for the next
+	 * sync is taken before the flags of the last one are read, so that a note
+	 * edited meanwhile is flagged again next time instead of taken as synced.
+	 * The calls are handled by KNotes in the order they are sent. */
+	int mark = 0;
+	if (knotesWasRunning || knotesStarted) {
+		char *value = osync_sink_state_get(state_db, "knotes_mark", &error);
+		if (value) {
+			mark = (strcmp(value, "1") == 0) ? 1 : 0;
+			osync_free(value);
+		}
+		else
+			osync_error_unref(&error);
 
-	QMap<KNoteID_t,QString>::ConstIterator i;
-	for (i = fNotes.begin(); i != fNotes.end(); i++) {
-		osync_trace(TRACE_INTERNAL, "reporting notes %s\n", static_cast<const char*>(i.key().utf8()));
+		if (!osync_sink_state_set(state_db, "knotes_synced", "false", &error)) {
+			osync_context_report_osyncerror(ctx, error);
+			osync_trace(TRACE_EXIT_ERROR, "%s: %s", __PRETTY_FUNCTION__, osync_error_print(&error));
+			osync_error_unref(&error);
+			return;
+		}
+		nextMark = 1 - mark;
+		kn_iface->sync(markApp(nextMark));
+		queued("sync");
+	}
 
-		QString uid = i.key();
-		QString data = i.data() + '\n' + strip_html(kn_iface->text(i.key()));
-		hash_value.update(data.utf8());
-		QString hash = hash_value.base64Digest();
+	if (!fetchNotes(fNotes, fTexts, fChanged, incremental ? hashtable : 0, markApp(mark))) {
+		osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Unable to get changed notes");
+		osync_trace(TRACE_EXIT_ERROR, "%s: Unable to get changed notes", __func__);
+		return;
+	}
+
+	OSyncObjFormat *objformat = report_format(info, XMLFORMAT_NOTE, "memo");
 
-		if ( !report_change(sink, info, ctx, uid, data, hash, objformat) ) {
-			osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Failed to get changes");
-			osync_trace(TRACE_EXIT_ERROR, "%s", __PRETTY_FUNCTION__);
+	// notes read from the file come with their texts; those fetched from KNotes
+	// are fetched and reported a window at a time, so that only a bounded number
+	// of texts is held at once
+	bool ok = reportTexts(sink, info, ctx, fNotes, fTexts, objformat);
+
+	QValueList<KNoteID_t>::ConstIterator c = fChanged.begin();
+	while (ok && c != fChanged.end()) {
+		QValueList<KNoteID_t> window;
+		for (; c != fChanged.end() && window.count() < TEXT_WINDOW; ++c)
+			window.append(*c);
+
+		if (!fetchTexts(window, fTexts)) {
+			osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Unable to get changed notes");
+			osync_trace(TRACE_EXIT_ERROR, "%s: Unable to get changed notes", __func__);
 			return;
 		}
+		ok = reportTexts(sink, info, ctx, fNotes, fTexts, objformat);
+	}
 
-		hash_value.reset();
+	QMap<KNoteID_t,QString>::ConstIterator i;
+	for (i = fNotes.begin(); ok && i != fNotes.end(); i++) {
+		// not changed according to KNotes, so it still has the hash we know
+		QString uid = i.key();
+		QString hash = QString::fromUtf8(osync_hashtable_get_hash(hashtable, uid.utf8()));
+		ok = report_change(sink, info, ctx, uid, QString::null, hash, objformat);
+	}
+
+	if (!ok) {
+		osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Failed to get changes");
+		osync_trace(TRACE_EXIT_ERROR, "%s", __PRETTY_FUNCTION__);
+		return;
 	}
 
 	if (!report_deleted(sink, info, ctx, objformat)) {
@@ -195,10 +569,22 @@ void KNotesDataSource::commit(OSyncObjTypeSink *sink, OSyncPluginInfo *, OSyncCo
 
 	QString uid = QString::fromUtf8(osync_change_get_uid(chg));
 
-	KMD5 hash_value;
+	if (!startKNotes(ctx)) {
+		osync_trace(TRACE_EXIT_ERROR, "%s: Unable to start knotes", __func__);
+		return;
+	}
+
+	// once per batch, so that KNotes doesn't pop up the notes we are changing
+	if (!notesHidden) {
+		kn_iface->hideAllNotes();
+		queued("hideAllNotes");
+		notesHidden = true;
+	}
 
 	if (type != OSYNC_CHANGE_TYPE_DELETED) {
-                QString data = QString::fromUtf8(cdata);
+		OSyncObjFormat *objformat = osync_data_get_objformat(odata);
+		bool xml = objformat && strcmp(osync_objformat_get_name(objformat), XMLFORMAT_NOTE) == 0;
+                QString data = xml ? xmlformat_memo(odata) : QString::fromUtf8(cdata);
                 QString summary = data.section('\n', 0, 0);  // first line
                 QString body = data.section('\n', 1);  // rest
 
@@ -213,30 +599,20 @@ void KNotesDataSource::commit(OSyncObjTypeSink *sink, OSyncPluginInfo *, OSyncCo
 				}
 
 				kn_iface->hideNote(uid);
-				if (kn_iface->status() != DCOPStub::CallSucceeded)
-					osync_trace(TRACE_INTERNAL, "ERROR: Unable to hide note");
-				hash_value.update(data);
-				hash = hash_value.base64Digest();
+				queued("hideNote");
+				hash = fingerprint(data.utf8());
 				osync_change_set_uid(chg, uid);
 				osync_change_set_hash(chg, hash);
 				break;
 			}
 			case OSYNC_CHANGE_TYPE_MODIFIED: {
 				kn_iface->setName(uid, summary);
-				if (kn_iface->status() != DCOPStub::CallSucceeded) {
-					osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Unable to set name");
-					osync_trace(TRACE_EXIT_ERROR, "%s: Unable to set name", __func__);
-					return;
-				}
+				queued("setName");
 
 				kn_iface->setText(uid, body);
-				if (kn_iface->status() != DCOPStub::CallSucceeded) {
-					osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Unable to set text");
-					osync_trace(TRACE_EXIT_ERROR, "%s: Unable to set text", __func__);
-					return;
-				}
-				hash_value.update(data);
-				hash = hash_value.base64Digest();
+				queued("setText");
+
+				hash = fingerprint(data.utf8());
 				osync_change_set_hash(chg, hash);
 				break;
 			}
@@ -247,21 +623,73 @@ void KNotesDataSource::commit(OSyncObjTypeSink *sink, OSyncPluginInfo *, OSyncCo
 			}
 		}
 	} else {
-		system("dcop knotes KNotesIface hideAllNotes");
-		QString asdasd = "dcop knotes KNotesIface killNote " + uid + " true";
-		system((const char*)asdasd.local8Bit());
-		/*kn_iface->killNote(uid, true);
-		if (kn_iface->status() != DCOPStub::CallSucceeded) {
-			osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Unable to delete note");
-			osync_trace(TRACE_EXIT_ERROR, "%s: Unable to delete note", __func__);
-			return false;
-		}*/
+		// force: don't ask for confirmation
+		kn_iface->killNote(uid, true);
+		queued("killNote");
 	}
 
-	OSyncHashTable *hashtable = osync_objtype_sink_get_hashtable(sink);
-	osync_hashtable_update_change(hashtable, chg);
+	defer_hash_update(chg);
 	osync_context_report_success(ctx);
 	osync_trace(TRACE_EXIT, "%s", __func__);
 }
 
 //--------------------------------------------------------------------------------
+
+/** Check the result of an ASYNC call to KNotes. Such calls are only queued on
+ * the DCOP connection, so failures are collected and reported in sync_done().
+ */
+void KNotesDataSource::queued(const char *call)
+{
+	if (kn_iface->status() != DCOPStub::CallSucceeded) {
+		osync_trace(TRACE_INTERNAL, "ERROR: Unable to send %s", call);
+		failedCalls++;
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+void KNotesDataSource::sync_done(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p)", __func__, ctx);
+
+	if (knotesWasRunning || knotesStarted) {
+		// a synchronous call is only answered after KNotes has processed all
+		// calls queued before it
+		QCString replyType;
+		QByteArray replyData;
+		if (!kn_dcop->call("knotes", "KNotesIface", "interfaces()", QByteArray(), replyType, replyData))
+			failedCalls++;
+	}
+
+	if (failedCalls) {
+		// the hashtable has the content which was meant to be written, a fast
+		// sync would take what KNotes kept as changed and undo the peer's edits
+		hashUpdates.clear();
+		request_slow_sync(sink);
+
+		osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "%d calls to knotes failed", failedCalls);
+		osync_trace(TRACE_EXIT_ERROR, "%s: %d calls to knotes failed", __func__, failedCalls);
+		failedCalls = 0;
+		return;
+	}
+
+	if (knotesWasRunning || knotesStarted) {
+		// the next sync reads the flags of the mark taken in get_changes
+		OSyncError *error = NULL;
+		OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(sink);
+		if ((nextMark >= 0 && !osync_sink_state_set(state_db, "knotes_mark", nextMark ? "1" : "0", &error)) ||
+		    !osync_sink_state_set(state_db, "knotes_synced", "true", &error)) {
+			osync_context_report_osyncerror(ctx, error);
+			osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
+			osync_error_unref(&error);
+			return;
+		}
+	}
+
+	OSyncDataSource::sync_done(sink, info, ctx);
+	osync_trace(TRACE_EXIT, "%s", __func__);
+}
+
+//--------------------------------------------------------------------------------
+
+#include "knotes.moc"
@@ -39,6 +39,8 @@ SOFTWARE IS DISCLAIMED.
 #include <dcopclient.h>
 #include <qstring.h>
 #include <qstringlist.h>
+#include <qobject.h>
+#include <qvaluelist.h>
 
 #include <errno.h>
 #include <sys/types.h>
@@ -49,18 +51,82 @@ typedef QString KNoteID_t;
 
 #include "datasource.h"
 
+#include <opensync/opensync-xmlformat.h>
+
+/** Sends the same DCOP call for many notes to KNotes without waiting for
+ * each reply, and collects the replies when they arrive.
+ */
+class KNotesBatchCall : public QObject
+{
+	Q_OBJECT
+
+	public:
+		KNotesBatchCall(DCOPClient *client) : client(client), failed(false) {}
+
+		/** Call fun (e.g. "text(QString)") for every note id and wait for all replies.
+		 * If app is given, it is passed as first argument before the note id.
+		 * Returns false if a call could not be sent, failed, or timed out.
+		 */
+		bool call(const QCString &fun, const QValueList<KNoteID_t> &ids, const QCString &replyType, int timeout,
+		          const QString &app = QString::null);
+
+		/** the reply data of every note id, valid after call() succeeded */
+		QMap<KNoteID_t, QByteArray> replies;
+
+	private slots:
+		void reply(int callId, const QCString &replyType, const QByteArray &replyData);
+		void timeout();
+
+	private:
+		DCOPClient *client;
+		QMap<int, KNoteID_t> pending;
+		QCString expectedType;
+		bool failed;
+};
+
+/** Waits in the event loop until a starting KNotes can be reached through DCOP.
+ * KNotes registers with DCOP before it has created its DCOP objects, so after
+ * the registration the KNotesIface object is looked up again until it is there.
+ */
+class KNotesStartup : public QObject
+{
+	Q_OBJECT
+
+	public:
+		KNotesStartup(DCOPClient *client) : client(client), done(false), reachable(false) {}
+
+		/** Returns false if the KNotesIface object is not there within msecs */
+		bool wait(int msecs);
+
+	private slots:
+		void registered(const QCString &appId);
+		void check();
+		void timeout();
+
+	private:
+		DCOPClient *client;
+		QTimer retry;
+		bool done;
+		bool reachable;
+};
+
 /** KNotes access implementation interface
  */
 class KNotesDataSource : public OSyncDataSource
 {
   public:
-		KNotesDataSource() : OSyncDataSource("note") {};
+		KNotesDataSource() : OSyncDataSource("note"), kn_dcop(0), kn_iface(0), knotesWasRunning(false), knotesStarted(false),
+		                     notesHidden(false), failedCalls(0), nextMark(-1) {};
 		virtual ~KNotesDataSource() {};
 
 		virtual void connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
 		virtual void disconnect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
 		virtual void get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync);
 		virtual void commit(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *chg);
+		virtual void sync_done(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx);
+
+	protected:
+		virtual OSyncData *make_data(const char *data, unsigned int size, OSyncObjFormat *objformat, OSyncError **error);
 
 	private:
 		DCOPClient *kn_dcop;
@@ -68,6 +134,28 @@ class KNotesDataSource : public OSyncDataSource
 
 		/** Ugly hack to restart KNotes if it was running */
 		bool knotesWasRunning;
+		/** KNotes was started by us for committing changes */
+		bool knotesStarted;
+		/** hideAllNotes was already sent for this sync */
+		bool notesHidden;
+		/** number of queued (ASYNC) calls which could not be sent */
+		int failedCalls;
+		/** the name under which we sync with KNotes' change tracking */
+		QString syncApp;
+		/** the mark taken in get_changes(), stored in sync_done(); -1 if none */
+		int nextMark;
+
+		QString markApp(int mark) const;
+		void queued(const char *call);
 
 		bool saveNotes(OSyncContext *ctx);
+		bool startKNotes(OSyncContext *ctx);
+		bool waitForKNotes(int msecs);
+		bool fetchNotes(QMap<KNoteID_t,QString> &names, QMap<KNoteID_t,QString> &texts,
+		                QValueList<KNoteID_t> &changed, OSyncHashTable *hashtable, const QString &app);
+		bool fetchTexts(const QValueList<KNoteID_t> &ids, QMap<KNoteID_t,QString> &texts);
+		bool reportTexts(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx,
+		                 QMap<KNoteID_t,QString> &names, QMap<KNoteID_t,QString> &texts,
+		                 OSyncObjFormat *objformat);
+		bool readNotesFile(QMap<KNoteID_t,QString> &names, QMap<KNoteID_t,QString> &texts);
 };
@@ -0,0 +1,184 @@
+/**
+ * Memory use at the boundaries of the sync phases
+ */
+
+#include <qfile.h>
+#include <qdatetime.h>
+
+#include <opensync/opensync.h>
+
+#include "memprofile.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <malloc.h>
+
+// the hooks were removed from glibc 2.34
+#if defined(__GLIBC__) && defined(__MALLOC_HOOK_VOLATILE)
+#define HAVE_MALLOC_HOOKS
+#endif
+
+static Q_INT64 allocCount = 0;
+static Q_INT64 allocBytes = 0;
+
+#ifdef HAVE_MALLOC_HOOKS
+
+static void *(*oldMallocHook)(size_t, const void *);
+static void *(*oldReallocHook)(void *, size_t, const void *);
+
+static void *countingMalloc(size_t size, const void *);
+static void *countingRealloc(void *ptr, size_t size, const void *);
+
+/* The hooks are uninstalled while calling malloc itself. OpenSync allocates in
+ * other threads meanwhile, so some of their allocations are missed; that is good
+ * enough for attributing the bulk of them.
+ */
+static void *countingMalloc(size_t size, const void *)
+{
+	__malloc_hook = oldMallocHook;
+	void *ptr = malloc(size);
+	__malloc_hook = countingMalloc;
+
+	__sync_fetch_and_add(&allocCount, 1);
+	__sync_fetch_and_add(&allocBytes, size);
+	return ptr;
+}
+
+static void *countingRealloc(void *ptr, size_t size, const void *)
+{
+	__realloc_hook = oldReallocHook;
+	void *result = realloc(ptr, size);
+	__realloc_hook = countingRealloc;
+
+	__sync_fetch_and_add(&allocCount, 1);
+	__sync_fetch_and_add(&allocBytes, size);
+	return result;
+}
+
+/** Start counting; the hooks stay for the lifetime of the process */
+static void installHooks()
+{
+	if (__malloc_hook == countingMalloc)
+		return;
+
+	oldMallocHook = __malloc_hook;
+	oldReallocHook = __realloc_hook;
+	__malloc_hook = countingMalloc;
+	__realloc_hook = countingRealloc;
+}
+
+#else
+
+static void installHooks()
+{
+}
+
+#endif
+
+//--------------------------------------------------------------------------------
+
+void MemProfile::enable(const QString &name, const QString &fileName)
+{
+	enabled = true;
+	this->name = name;
+	this->fileName = fileName;
+	installHooks();
+}
+
+//--------------------------------------------------------------------------------
+
+MemProfile::Sample MemProfile::sample(const QCString &phase)
+{
+	Sample s;
+	s.phase = phase;
+
+	// second field: resident pages
+	long size = 0, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm) {
+		if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+			resident = 0;
+		fclose(statm);
+	}
+	s.rss = Q_INT64(resident) * sysconf(_SC_PAGESIZE);
+
+	struct mallinfo info = mallinfo();
+	s.heap = Q_INT64((unsigned int) info.uordblks) + Q_INT64((unsigned int) info.hblkhd);
+
+	s.allocs = allocCount;
+	s.allocBytes = allocBytes;
+	return s;
+}
+
+//--------------------------------------------------------------------------------
+
+void MemProfile::begin()
+{
+	if (!enabled)
+		return;
+
+	samples.clear();
+	calls = 0;
+	samples.append(sample("start"));
+}
+
+//--------------------------------------------------------------------------------
+
+void MemProfile::mark(const char *phase)
+{
+	if (!enabled)
+		return;
+
+	if (samples.isEmpty())
+		begin();
+	samples.append(sample(phase));
+}
+
+//--------------------------------------------------------------------------------
+
+void MemProfile::markEvery(const char *phase, unsigned int n)
+{
+	if (!enabled)
+		return;
+
+	if (++calls % n == 0)
+		mark(QCString(phase) + " #" + QCString().setNum(calls));
+}
+
+//--------------------------------------------------------------------------------
+
+void MemProfile::report()
+{
+	if (!enabled || samples.isEmpty())
+		return;
+
+	QCString text;
+	char line[160];
+	text += "memory profile of " + name.local8Bit() + ", " + QDateTime::currentDateTime().toString(Qt::ISODate).latin1() + "\n";
+	snprintf(line, sizeof(line), "%-20s %10s %10s %10s %10s %10s %10s\n",
+	         "phase", "RSS KB", "+RSS KB", "heap KB", "+heap KB", "+allocs", "+alloc KB");
+	text += line;
+
+	const Sample *previous = 0;
+	for (QValueList<Sample>::ConstIterator it = samples.begin(); it != samples.end(); ++it) {
+		const Sample &s = *it;
+		const Sample &p = previous ? *previous : s;
+		snprintf(line, sizeof(line), "%-20s %10lld %10lld %10lld %10lld %10lld %10lld\n", (const char *) s.phase,
+		         (long long) s.rss / 1024, (long long) (s.rss - p.rss) / 1024,
+		         (long long) s.heap / 1024, (long long) (s.heap - p.heap) / 1024,
+		         (long long) (s.allocs - p.allocs), (long long) (s.allocBytes - p.allocBytes) / 1024);
+		text += line;
+		previous = &s;
+	}
+	samples.clear();
+
+	osync_trace(TRACE_INTERNAL, "%s", (const char *) text);
+
+	QFile file(fileName);
+	if (file.open(IO_WriteOnly | IO_Truncate)) {
+		file.writeBlock(text.data(), text.length());
+		file.close();
+	}
+	else
+		osync_trace(TRACE_INTERNAL, "unable to write the memory profile to %s", (const char *) QFile::encodeName(fileName));
+}
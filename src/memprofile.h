@@ -0,0 +1,54 @@
+#ifndef KDEPIM_OSYNC_MEMPROFILE_H
+#define KDEPIM_OSYNC_MEMPROFILE_H
+
+#include <qstring.h>
+#include <qcstring.h>
+#include <qvaluelist.h>
+
+/* Opt-in record of the memory use of the plugin process at the boundaries of
+ * the sync phases, see the MemoryProfile option. Every mark samples the
+ * resident set size, the heap in use, and the number and bytes of allocations
+ * so far; the report lists the samples with the growth since the previous one.
+ *
+ * The allocation counters cover the whole process, they need glibc's malloc
+ * hooks and stay 0 without them.
+ */
+class MemProfile
+{
+	public:
+		MemProfile() : enabled(false), calls(0) {}
+
+		/* start profiling; name titles the report, which is written to fileName */
+		void enable(const QString &name, const QString &fileName);
+		bool isEnabled() const { return enabled; }
+
+		/* forget the previous samples and take the baseline */
+		void begin();
+		/* sample the state after a phase */
+		void mark(const char *phase);
+		/* sample after every n-th call, e.g. for batches of commits */
+		void markEvery(const char *phase, unsigned int n);
+
+		/* write the report, trace it, and forget the samples */
+		void report();
+
+	private:
+		struct Sample
+		{
+			QCString phase;
+			Q_INT64 rss;         // bytes
+			Q_INT64 heap;        // bytes in use
+			Q_INT64 allocs;      // number of allocations
+			Q_INT64 allocBytes;  // bytes requested by them
+		};
+
+		static Sample sample(const QCString &phase);
+
+		bool enabled;
+		QString name;
+		QString fileName;
+		unsigned int calls;
+		QValueList<Sample> samples;
+};
+
+#endif // KDEPIM_OSYNC_MEMPROFILE_H
@@ -0,0 +1,265 @@
+/**
+ * Concurrent enumeration of the stores in child processes
+ */
+
+#include <dcopclient.h>
+#include <qapplication.h>
+#include <qdatastream.h>
+
+#include "prefetch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+// loading a large calendar or addressbook might take a while
+static const int PREFETCH_TIMEOUT = 10 * 60 * 1000;
+
+static const int PREFETCH_WINDOW = 1024 * 1024;
+
+//--------------------------------------------------------------------------------
+
+bool Prefetch::start(Producer &producer)
+{
+	cancel();
+
+	// a socket rather than a pipe, SyncHelper::writeBlock() uses send()
+	int fds[2];
+	if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return false;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	// the window by which the child may get ahead of the plugin
+	int window = PREFETCH_WINDOW;
+	::setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &window, sizeof(window));
+
+	pid = forkChild();
+	if (pid < 0) {
+		::close(fds[0]);
+		::close(fds[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		::close(fds[0]);
+
+		bool ok = producer.produce(fds[1]);
+
+		// no destructors or atexit handlers, they belong to the plugin
+		_exit(ok ? 0 : 1);
+	}
+
+	::close(fds[1]);
+	fd = fds[0];
+	osync_trace(TRACE_INTERNAL, "prefetching in child %d", pid);
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Only a plugin without GUI is forked. A GUI application also holds its
+ * connection to the X server, and those of the session manager and of KIO
+ * which come with it; the child would share all of them with the plugin.
+ */
+bool Prefetch::canFork()
+{
+	return !qApp || qApp->type() == QApplication::Tty;
+}
+
+//--------------------------------------------------------------------------------
+
+pid_t Prefetch::forkChild()
+{
+	if (!canFork()) {
+		osync_trace(TRACE_INTERNAL, "not forking a GUI application");
+		return -1;
+	}
+
+	pid_t pid = ::fork();
+	if (pid < 0)
+		return -1;
+
+	// the child shares the plugin's connection to the DCOP server; anything
+	// written to it would corrupt the plugin's own conversation
+	DCOPClient *client = DCOPClient::mainClient();
+	if (pid == 0 && client && client->socket() >= 0) {
+		int null = ::open("/dev/null", O_RDWR);
+		::dup2(null, client->socket());
+		::close(null);
+	}
+	return pid;
+}
+
+//--------------------------------------------------------------------------------
+
+bool Prefetch::readHeader()
+{
+	QByteArray header;
+	if (!SyncHelper::readBlock(fd, header, PREFETCH_TIMEOUT))
+		return false;
+
+	QDataStream in(header, IO_ReadOnly);
+	Q_UINT32 count = 0;
+	in >> count;
+	partCount = count;
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Keep the next part in memory, as a later one is taken first */
+bool Prefetch::bufferPart()
+{
+	Part part;
+	bool last = false;
+	while (!last) {
+		QByteArray chunk;
+		if (!SyncHelper::readBlock(fd, chunk, PREFETCH_TIMEOUT))
+			return false;
+
+		QDataStream in(chunk, IO_ReadOnly);
+		Q_UINT32 count = 0;
+		in >> count;
+		last = (count == 0);
+		part.chunks.append(chunk);
+	}
+	if (!SyncHelper::readBlock(fd, part.journal, PREFETCH_TIMEOUT))
+		return false;
+
+	buffered.insert(nextPart++, part);
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Reap the child once everything was read, or kill it when giving up */
+void Prefetch::finish()
+{
+	if (pid <= 0)
+		return;
+
+	if (nextPart < (unsigned int) partCount || partCount < 0)
+		::kill(pid, SIGKILL);
+
+	int status = 0;
+	while (::waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	::close(fd);
+	pid = -1;
+	fd = -1;
+}
+
+//--------------------------------------------------------------------------------
+
+void Prefetch::readJournal(const QByteArray &block, ChangeJournal &journal)
+{
+	QDataStream in(block, IO_ReadOnly);
+	Q_INT8 valid = 0;
+	in >> valid;
+	if (!valid || !journal.read(in))
+		journal.clear();
+}
+
+//--------------------------------------------------------------------------------
+
+SyncHelper::FetchResult Prefetch::take(unsigned int part, ItemVisitor &visitor, ChangeJournal &journal)
+{
+	QMap<unsigned int, Part>::Iterator it = buffered.find(part);
+	if (it != buffered.end()) {
+		Part p = *it;
+		buffered.remove(it);
+
+		SyncHelper::FetchResult result = SyncHelper::Done;
+		bool last = false;
+		for (QValueList<QByteArray>::Iterator c = p.chunks.begin(); c != p.chunks.end() && result == SyncHelper::Done; ) {
+			result = SyncHelper::visitChunk(*c, visitor, last);
+			c = p.chunks.remove(c);  // release what was reported
+		}
+		if (result == SyncHelper::Done)
+			readJournal(p.journal, journal);
+		return result;
+	}
+
+	if (pid <= 0)
+		return SyncHelper::Unavailable;
+
+	if (partCount < 0 && !readHeader()) {
+		osync_trace(TRACE_INTERNAL, "prefetch failed");
+		finish();
+		return SyncHelper::Unavailable;
+	}
+
+	while (nextPart < part && nextPart < (unsigned int) partCount) {
+		if (!bufferPart()) {
+			osync_trace(TRACE_INTERNAL, "prefetch failed");
+			finish();
+			return SyncHelper::Unavailable;
+		}
+	}
+
+	if (part != nextPart || part >= (unsigned int) partCount)
+		return SyncHelper::Unavailable;
+
+	SyncHelper::FetchResult result = SyncHelper::visitItems(fd, visitor, PREFETCH_TIMEOUT);
+	QByteArray block;
+	if (result == SyncHelper::Done && !SyncHelper::readBlock(fd, block, PREFETCH_TIMEOUT))
+		result = SyncHelper::Failed;
+
+	if (result != SyncHelper::Done) {
+		// the stream can not be continued after a partial part
+		osync_trace(TRACE_INTERNAL, "prefetch failed");
+		partCount = -1;
+		finish();
+		return result;
+	}
+
+	nextPart++;
+	if (nextPart == (unsigned int) partCount)
+		finish();
+
+	readJournal(block, journal);
+	return result;
+}
+
+//--------------------------------------------------------------------------------
+
+void Prefetch::cancel()
+{
+	if (pid > 0) {
+		::kill(pid, SIGKILL);
+		while (::waitpid(pid, 0, 0) < 0 && errno == EINTR)
+			;
+		::close(fd);
+	}
+	pid = -1;
+	fd = -1;
+	partCount = -1;
+	nextPart = 0;
+	buffered.clear();
+}
+
+//--------------------------------------------------------------------------------
+
+bool Prefetch::writeHeader(int fd, unsigned int parts)
+{
+	QByteArray header;
+	QDataStream out(header, IO_WriteOnly);
+	out << (Q_UINT32) parts;
+	return SyncHelper::writeBlock(fd, header);
+}
+
+//--------------------------------------------------------------------------------
+
+bool Prefetch::writeJournal(int fd, const ChangeJournal &journal)
+{
+	QByteArray block;
+	QDataStream out(block, IO_WriteOnly);
+	out << (Q_INT8) journal.isValid();
+	if (journal.isValid())
+		journal.write(out);
+	return SyncHelper::writeBlock(fd, block);
+}
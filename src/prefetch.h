@@ -0,0 +1,77 @@
+#ifndef KDEPIM_OSYNC_PREFETCH_H
+#define KDEPIM_OSYNC_PREFETCH_H
+
+#include <qvaluelist.h>
+#include <qmap.h>
+#include <qcstring.h>
+#include <sys/types.h>
+
+#include "synchelper.h"
+
+/* Loads and serializes a store in a forked child process, so that the stores of
+ * all sinks are enumerated concurrently while OpenSync calls the sinks one after
+ * the other. The items are reported later from the plugin's own thread.
+ *
+ * A child process is used instead of a thread, as neither KDE's global objects
+ * nor the reference counts of Qt's shared values are thread-safe in KDE 3.
+ * A plugin running as a GUI application is not forked, see canFork(); its
+ * sinks enumerate their stores themselves.
+ *
+ * The child writes a header with the number of parts, then per part the item
+ * chunks as written by a CollectVisitor and a journal block (Q_INT8 valid,
+ * followed by the journal). The chunks are read while they are reported, so the
+ * child only gets ahead of the plugin by the window of the socket buffer. Only
+ * a part which is taken out of order is held in memory.
+ */
+class Prefetch
+{
+	public:
+		/* runs in the child and writes all parts */
+		class Producer
+		{
+			public:
+				virtual ~Producer() {}
+				virtual bool produce(int fd) = 0;
+		};
+
+		Prefetch() : pid(-1), fd(-1), partCount(-1), nextPart(0) {}
+		~Prefetch() { cancel(); }
+
+		bool start(Producer &producer);
+		bool isStarted() const { return pid > 0 || !buffered.isEmpty(); }
+
+		/* visit the items of a part as they arrive from the child, and take its journal */
+		SyncHelper::FetchResult take(unsigned int part, ItemVisitor &visitor, ChangeJournal &journal);
+
+		/* stop the child and drop the results */
+		void cancel();
+
+		/* false if the plugin can't be forked, e.g. as a GUI application */
+		static bool canFork();
+		/* fork a child of the plugin, detached from the plugin's connections;
+		 * -1 if there is no child */
+		static pid_t forkChild();
+
+		static bool writeHeader(int fd, unsigned int parts);
+		static bool writeJournal(int fd, const ChangeJournal &journal);
+
+	private:
+		struct Part
+		{
+			QValueList<QByteArray> chunks;
+			QByteArray journal;
+		};
+
+		bool readHeader();
+		bool bufferPart();
+		void finish();
+		static void readJournal(const QByteArray &block, ChangeJournal &journal);
+
+		pid_t pid;
+		int fd;
+		int partCount;
+		unsigned int nextPart;
+		QMap<unsigned int, Part> buffered;
+};
+
+#endif // KDEPIM_OSYNC_PREFETCH_H
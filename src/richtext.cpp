@@ -0,0 +1,246 @@
+/**
+ * Plain text of the rich text bodies of notes
+ */
+
+#include <opensync/opensync.h>
+
+#include "richtext.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//--------------------------------------------------------------------------------
+
+/** Position of the first character at or after pos which can't be copied
+ * verbatim from rich text: the start of a tag or an entity, or a control
+ * character such as a raw line break.
+ */
+static uint next_markup(const ushort *s, uint pos, uint len)
+{
+#ifdef __SSE2__
+	const __m128i lt = _mm_set1_epi16('<');
+	const __m128i amp = _mm_set1_epi16('&');
+	const __m128i ctl = _mm_set1_epi16(0x1f);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; pos + 8 <= len; pos += 8) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + pos));
+		// (v -sat 0x1f) == 0  <=>  v <= 0x1f, compared unsigned
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(v, lt), _mm_cmpeq_epi16(v, amp)),
+		                           _mm_cmpeq_epi16(_mm_subs_epu16(v, ctl), zero));
+		int mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return pos + (__builtin_ctz(mask) >> 1);
+	}
+#endif
+	for (; pos < len; pos++) {
+		ushort c = s[pos];
+		if (c == '<' || c == '&' || c < 0x20)
+			return pos;
+	}
+	return len;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Case insensitive compare of s[pos, pos + strlen(name)) with the lower case name */
+static bool matches(const ushort *s, uint pos, uint len, const char *name)
+{
+	for (; *name; name++, pos++) {
+		if (pos >= len)
+			return false;
+		ushort c = s[pos];
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		if (c != static_cast<uchar>(*name))
+			return false;
+	}
+	return true;
+}
+
+/** Find the first occurrence of the lower case string name at or after pos */
+static uint find(const ushort *s, uint pos, uint len, const char *name)
+{
+	for (; pos < len; pos++) {
+		if (matches(s, pos, len, name))
+			return pos;
+	}
+	return len;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Decode the entity starting with '&' at s[pos].
+ * Returns the decoded character and sets next behind the ';', or returns 0 if
+ * this is not a known entity.
+ */
+static ushort decode_entity(const ushort *s, uint pos, uint len, uint &next)
+{
+	static const struct { const char *name; ushort c; } entities[] = {
+		{ "amp;", '&' }, { "lt;", '<' }, { "gt;", '>' }, { "quot;", '"' },
+		{ "apos;", '\'' }, { "nbsp;", ' ' }, { 0, 0 }
+	};
+
+	pos++;
+	if (pos < len && s[pos] == '#') {
+		uint base = 10;
+		pos++;
+		if (pos < len && (s[pos] == 'x' || s[pos] == 'X')) {
+			base = 16;
+			pos++;
+		}
+		uint value = 0, digits = 0;
+		for (; pos < len && digits < 8; pos++, digits++) {
+			ushort c = s[pos];
+			uint d;
+			if (c >= '0' && c <= '9')
+				d = c - '0';
+			else if (base == 16 && c >= 'a' && c <= 'f')
+				d = c - 'a' + 10;
+			else if (base == 16 && c >= 'A' && c <= 'F')
+				d = c - 'A' + 10;
+			else
+				break;
+			value = value * base + d;
+		}
+		if (!digits || pos >= len || s[pos] != ';' || value == 0 || value > 0xffff)
+			return 0;
+		next = pos + 1;
+		return value;
+	}
+
+	for (int i = 0; entities[i].name; i++) {
+		if (matches(s, pos, len, entities[i].name)) {
+			next = pos + strlen(entities[i].name);
+			return entities[i].c;
+		}
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Convert the rich text body of a note into plain text.
+ *
+ * The input is scanned once: runs of ordinary text are copied in bulk into a
+ * preallocated buffer, tags are dropped, block level tags and <br> become line
+ * breaks, raw whitespace is collapsed as a browser would do it, and entities
+ * are decoded. A body without any tag is a plain text note and only trimmed.
+ */
+QString strip_html(const QString &input)
+{
+	const uint len = input.length();
+	const ushort *in = reinterpret_cast<const ushort *>(input.unicode());
+
+	if (input.find('<') < 0)
+		return input.stripWhiteSpace();
+
+	// the output is never longer than the input
+	QChar *buf = new QChar[len];
+	ushort *out = reinterpret_cast<ushort *>(buf);
+	uint n = 0;
+
+	for (uint pos = 0; pos < len; ) {
+		uint stop = next_markup(in, pos, len);
+		if (stop > pos) {
+			memcpy(out + n, in + pos, (stop - pos) * sizeof(ushort));
+			n += stop - pos;
+			pos = stop;
+			if (pos >= len)
+				break;
+		}
+
+		ushort c = in[pos];
+
+		if (c == '&') {
+			uint next;
+			ushort decoded = decode_entity(in, pos, len, next);
+			if (decoded) {
+				out[n++] = decoded;
+				pos = next;
+			}
+			else
+				out[n++] = in[pos++];
+			continue;
+		}
+
+		if (c != '<') {
+			// a raw line break or tab is just whitespace in markup
+			if ((c == '\n' || c == '\r' || c == '\t') && n && out[n - 1] != ' ' && out[n - 1] != '\n')
+				out[n++] = ' ';
+			pos++;
+			continue;
+		}
+
+		// c == '<'
+		if (matches(in, pos, len, "<!--")) {
+			uint end = find(in, pos + 4, len, "-->");
+			pos = (end < len) ? end + 3 : len;
+			continue;
+		}
+
+		uint name = pos + 1;
+		bool closing = (name < len && in[name] == '/');
+		if (closing)
+			name++;
+
+		uint end = name;
+		while (end < len && in[end] != '>')
+			end++;
+
+		// drop elements whose content is not text
+		if (!closing && (matches(in, name, len, "head") || matches(in, name, len, "style") ||
+		                 matches(in, name, len, "script") || matches(in, name, len, "title"))) {
+			const char *close = matches(in, name, len, "head") ? "</head" :
+			                    matches(in, name, len, "style") ? "</style" :
+			                    matches(in, name, len, "script") ? "</script" : "</title";
+			end = find(in, end, len, close);
+			while (end < len && in[end] != '>')
+				end++;
+		}
+		else {
+			uint nameEnd = name;
+			while (nameEnd < end && ((in[nameEnd] >= 'a' && in[nameEnd] <= 'z') ||
+			                         (in[nameEnd] >= 'A' && in[nameEnd] <= 'Z') ||
+			                         (in[nameEnd] >= '0' && in[nameEnd] <= '9')))
+				nameEnd++;
+
+			static const char *blocks[] = {
+				"p", "div", "li", "tr", "ul", "ol", "table", "blockquote", "pre",
+				"h1", "h2", "h3", "h4", "h5", "h6", 0
+			};
+
+			bool lineBreak = (!closing && nameEnd - name == 2 && matches(in, name, len, "br"));
+			bool block = false;
+			for (int i = 0; !lineBreak && blocks[i]; i++) {
+				if (nameEnd - name == strlen(blocks[i]) && matches(in, name, len, blocks[i]))
+					block = true;
+			}
+
+			if (lineBreak || block) {
+				while (n && out[n - 1] == ' ')
+					n--;
+				if (lineBreak || (n && out[n - 1] != '\n'))
+					out[n++] = '\n';
+			}
+		}
+
+		pos = (end < len) ? end + 1 : len;
+	}
+
+	// trim leading and trailing whitespace
+	uint first = 0;
+	while (first < n && QChar(out[first]).isSpace())
+		first++;
+	while (n > first && QChar(out[n - 1]).isSpace())
+		n--;
+
+	QString output(buf + first, n - first);
+	delete [] buf;
+
+	osync_trace(TRACE_SENSITIVE, "output is %s\n", (const char*)output.local8Bit());
+	return output;
+}
@@ -0,0 +1,10 @@
+#ifndef KDEPIM_OSYNC_RICHTEXT_H
+#define KDEPIM_OSYNC_RICHTEXT_H
+
+#include <qstring.h>
+
+/* the plain text of the rich text body of a note; a body without any tag is
+ * only trimmed */
+QString strip_html(const QString &input);
+
+#endif // KDEPIM_OSYNC_RICHTEXT_H
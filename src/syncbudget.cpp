@@ -0,0 +1,53 @@
+/**
+ * Bounded reporting of changes, the most relevant ones first
+ */
+
+#include <qtl.h>
+
+#include "syncbudget.h"
+#include "changejournal.h"
+
+//--------------------------------------------------------------------------------
+
+void SyncBudget::setup(unsigned int maxChanges, unsigned int seconds)
+{
+	this->maxChanges = maxChanges;
+	this->seconds = seconds;
+}
+
+//--------------------------------------------------------------------------------
+
+bool SyncBudget::begin(osync_bool slow_sync)
+{
+	items.clear();
+	active = isEnabled() && !slow_sync;
+	spent = 0;
+	return active;
+}
+
+//--------------------------------------------------------------------------------
+
+QValueList<SyncBudget::Item> SyncBudget::take()
+{
+	QValueList<Item> sorted = items;
+	items.clear();
+	active = false;
+	start = ChangeJournal::now();
+
+	qHeapSort(sorted);
+	return sorted;
+}
+
+//--------------------------------------------------------------------------------
+
+bool SyncBudget::allows(unsigned int reported) const
+{
+	// loading and enumerating might take longer than the whole budget
+	if (reported == 0)
+		return true;
+
+	if (maxChanges > 0 && spent + reported >= maxChanges)
+		return false;
+
+	return seconds == 0 || ChangeJournal::now() - start < Q_INT64(seconds) * 1000000000;
+}
@@ -0,0 +1,68 @@
+#ifndef KDEPIM_OSYNC_SYNCBUDGET_H
+#define KDEPIM_OSYNC_SYNCBUDGET_H
+
+#include <qcstring.h>
+#include <qvaluelist.h>
+#include <opensync/opensync.h>
+#include <opensync/opensync-data.h>
+#include <opensync/opensync-format.h>
+
+/* Bounds the changes get_changes reports in one sync, by the MaxChanges and
+ * TimeBudget options.
+ *
+ * While a budget is active, the added items are held back until the
+ * enumeration is done, then reported by rank, the most relevant ones first,
+ * until the budget is used up; at least one is reported per sync, so that
+ * every sync makes progress. The items left over get no hashtable entry and
+ * show up as added again on the next sync.
+ *
+ * Modified items are reported right away and count against the budget: one
+ * held back would be overwritten by a change of the peer to the same item
+ * without a conflict. Deleted items carry no data and are always reported.
+ *
+ * A slow-sync is never bounded, the engine has to see every item then.
+ */
+class SyncBudget
+{
+	public:
+		struct Item
+		{
+			QCString uid;
+			QCString hash;
+			OSyncChangeType type;
+			QByteArray data;
+			OSyncObjFormat *objformat;
+			int rank;  // lower ranks are reported first
+
+			bool operator<(const Item &other) const { return rank < other.rank; }
+		};
+
+		SyncBudget() : maxChanges(0), seconds(0), active(false), spent(0), start(0) {}
+
+		/* 0 for no limit */
+		void setup(unsigned int maxChanges, unsigned int seconds);
+		bool isEnabled() const { return maxChanges > 0 || seconds > 0; }
+
+		/* get_changes starts; returns true if the changes are held back */
+		bool begin(osync_bool slow_sync);
+		bool isActive() const { return active; }
+
+		void hold(const Item &item) { items.append(item); }
+		/* a change which was reported right away */
+		void spend() { spent++; }
+		/* the held back items by rank; the time budget starts now, and the
+		 * budget is inactive afterwards */
+		QValueList<Item> take();
+		/* true if another held back change fits after reported ones */
+		bool allows(unsigned int reported) const;
+
+	private:
+		unsigned int maxChanges;
+		unsigned int seconds;
+		bool active;
+		unsigned int spent;  // changes reported right away
+		Q_INT64 start;  // when take() was called, see ChangeJournal::now()
+		QValueList<Item> items;
+};
+
+#endif // KDEPIM_OSYNC_SYNCBUDGET_H
@@ -0,0 +1,299 @@
+/**
+ * Client side of the kdepim-sync-helper
+ */
+
+#include <kstandarddirs.h>
+#include <kprocess.h>
+#include <qdatastream.h>
+#include <qfile.h>
+
+#include <opensync/opensync.h>
+
+#include "synchelper.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+// loading a large calendar for the first request might take a while
+static const int REPLY_TIMEOUT = 120 * 1000;
+
+// a chunk is passed on once it holds this many bytes of serialized items
+static const unsigned int CHUNK_SIZE = 256 * 1024;
+
+//--------------------------------------------------------------------------------
+
+QString SyncHelper::socketPath()
+{
+	return locateLocal("socket", "kdepim-sync-helper");
+}
+
+//--------------------------------------------------------------------------------
+
+static bool writeAll(int fd, const char *data, unsigned int size)
+{
+	while (size > 0) {
+		// MSG_NOSIGNAL: a vanished peer must not kill us with SIGPIPE
+		ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+static bool readAll(int fd, char *data, unsigned int size, int timeout)
+{
+	while (size > 0) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		int ret = ::poll(&pfd, 1, timeout);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+
+		ssize_t n = ::read(fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (n == 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool SyncHelper::writeBlock(int fd, const QByteArray &block)
+{
+	Q_UINT32 length = htonl(block.size());
+	return writeAll(fd, (const char *) &length, sizeof(length)) &&
+	       writeAll(fd, block.data(), block.size());
+}
+
+//--------------------------------------------------------------------------------
+
+bool SyncHelper::readBlock(int fd, QByteArray &block, int timeout)
+{
+	Q_UINT32 length;
+	if (!readAll(fd, (char *) &length, sizeof(length), timeout))
+		return false;
+
+	if (!block.resize(ntohl(length)))
+		return false;
+
+	return readAll(fd, block.data(), block.size(), timeout);
+}
+
+//--------------------------------------------------------------------------------
+
+static int connectHelper()
+{
+	QCString path = QFile::encodeName(SyncHelper::socketPath());
+
+	struct sockaddr_un addr;
+	if (path.length() >= sizeof(addr.sun_path))
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.data());
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (::connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//--------------------------------------------------------------------------------
+
+SyncHelper::FetchResult SyncHelper::fetch(const char *objtype, const QStringList &categories, ItemVisitor &visitor)
+{
+	osync_trace(TRACE_ENTRY, "%s(%s)", __PRETTY_FUNCTION__, objtype);
+
+	int fd = connectHelper();
+	if (fd < 0) {
+		osync_trace(TRACE_EXIT, "%s: no helper running", __PRETTY_FUNCTION__);
+		return Unavailable;
+	}
+
+	QByteArray request;
+	QDataStream out(request, IO_WriteOnly);
+	out << (Q_UINT32) PROTOCOL_VERSION << QString::fromLatin1(objtype) << categories;
+
+	QByteArray block;
+	if (!writeBlock(fd, request) || !readBlock(fd, block, REPLY_TIMEOUT)) {
+		::close(fd);
+		osync_trace(TRACE_EXIT, "%s: helper did not answer", __PRETTY_FUNCTION__);
+		return Unavailable;
+	}
+
+	Q_INT8 ok;
+	QString error;
+	QDataStream status(block, IO_ReadOnly);
+	status >> ok >> error;
+	if (!ok) {
+		::close(fd);
+		osync_trace(TRACE_EXIT, "%s: helper refused: %s", __PRETTY_FUNCTION__, (const char *) error.local8Bit());
+		return Unavailable;
+	}
+
+	FetchResult result = visitItems(fd, visitor, REPLY_TIMEOUT);
+	::close(fd);
+	osync_trace(TRACE_EXIT, "%s: %s", __PRETTY_FUNCTION__,
+	            result == Done ? "done" : (result == Failed ? "failed" : "connection to helper broke"));
+	return result;
+}
+
+//--------------------------------------------------------------------------------
+
+SyncHelper::FetchResult SyncHelper::visitItems(int fd, ItemVisitor &visitor, int timeout)
+{
+	QByteArray chunk;
+	bool first = true, last = false;
+	while (!last) {
+		if (!readBlock(fd, chunk, timeout))
+			return first ? Unavailable : Failed;
+		first = false;
+
+		if (visitChunk(chunk, visitor, last) != Done)
+			return Failed;
+	}
+	return Done;
+}
+
+//--------------------------------------------------------------------------------
+
+SyncHelper::FetchResult SyncHelper::visitChunk(const QByteArray &chunk, ItemVisitor &visitor, bool &last)
+{
+	QDataStream in(chunk, IO_ReadOnly);
+	Q_UINT32 count = 0;
+	in >> count;
+	last = (count == 0);
+
+	QString uid, hash;
+	QByteArray data;
+	for (Q_UINT32 i = 0; i < count; i++) {
+		if (in.atEnd()) {
+			osync_trace(TRACE_INTERNAL, "truncated item chunk");
+			return Failed;
+		}
+		in >> uid >> hash >> data;
+		if (!visitor.item(uid, data.data(), data.size(), hash))
+			return Failed;
+	}
+	return Done;
+}
+
+//--------------------------------------------------------------------------------
+
+CollectVisitor::CollectVisitor(int fd)
+	: fd(fd), chunks(0), count(0), failed(false)
+{
+	startChunk();
+}
+
+//--------------------------------------------------------------------------------
+
+CollectVisitor::CollectVisitor(QValueList<QByteArray> &chunks)
+	: fd(-1), chunks(&chunks), count(0), failed(false)
+{
+	startChunk();
+}
+
+//--------------------------------------------------------------------------------
+
+void CollectVisitor::startChunk()
+{
+	buffer.setBuffer(QByteArray());
+	buffer.open(IO_WriteOnly);
+	stream.setDevice(&buffer);
+	stream << (Q_UINT32) 0;  // count, filled in by flush()
+	count = 0;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Pass on the current chunk and start a new one */
+bool CollectVisitor::flush()
+{
+	buffer.at(0);
+	stream << count;
+	stream.unsetDevice();
+	buffer.close();
+
+	QByteArray chunk = buffer.buffer();
+	if (chunks)
+		chunks->append(chunk);
+	else if (!SyncHelper::writeBlock(fd, chunk))
+		failed = true;
+
+	startChunk();
+	return !failed;
+}
+
+//--------------------------------------------------------------------------------
+
+bool CollectVisitor::item(const QString &uid, const char *data, unsigned int size, const QString &hash)
+{
+	if (failed)
+		return false;
+
+	stream << uid << hash;
+	stream.writeBytes(data, size);  // same as streaming a QByteArray, without a copy
+	count++;
+
+	return (buffer.size() < CHUNK_SIZE) || flush();
+}
+
+//--------------------------------------------------------------------------------
+
+bool CollectVisitor::unchanged(const QString &)
+{
+	// the receiver needs the data of every item
+	return false;
+}
+
+//--------------------------------------------------------------------------------
+
+bool CollectVisitor::finish()
+{
+	if (count > 0 && !flush())
+		return false;
+
+	// the empty chunk marks the end
+	return flush();
+}
+
+//--------------------------------------------------------------------------------
+
+void SyncHelper::start()
+{
+	// the helper makes sure that only one instance serves the socket
+	KProcess proc;
+	proc << "kdepim-sync-helper";
+	if (!proc.start(KProcess::DontCare))
+		osync_trace(TRACE_INTERNAL, "unable to start kdepim-sync-helper");
+}
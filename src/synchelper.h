@@ -0,0 +1,82 @@
+#ifndef KDEPIM_OSYNC_SYNCHELPER_H
+#define KDEPIM_OSYNC_SYNCHELPER_H
+
+#include <qstring.h>
+#include <qstringlist.h>
+#include <qcstring.h>
+#include <qbuffer.h>
+#include <qdatastream.h>
+#include <qvaluelist.h>
+
+#include "datasource.h"
+
+/* Client side of the kdepim-sync-helper, a long running process which keeps
+ * the calendar and the addressbook loaded and serialized between syncs.
+ *
+ * Protocol over the local socket, every block is a 32 bit length (network order)
+ * followed by QDataStream data:
+ *   request:  Q_UINT32 version, QString objtype, QStringList categories
+ *   status:   Q_INT8 ok, QString error
+ *   items:    chunk blocks of Q_UINT32 count, then count times QString uid,
+ *             QString hash, QByteArray data; a chunk without items ends them
+ *
+ * The items are sent in chunks of bounded size, so that neither side ever
+ * holds more than a chunk of serialized items for the other.
+ */
+class SyncHelper
+{
+	public:
+		enum { PROTOCOL_VERSION = 2 };
+
+		enum FetchResult
+		{
+			Unavailable,  // no helper or it refused, nothing was visited
+			Failed,       // the connection broke or the visitor stopped
+			Done          // all items were visited
+		};
+
+		static QString socketPath();
+
+		static FetchResult fetch(const char *objtype, const QStringList &categories, ItemVisitor &visitor);
+
+		/* start the helper in the background, it detaches from the caller */
+		static void start();
+
+		static bool writeBlock(int fd, const QByteArray &block);
+		static bool readBlock(int fd, QByteArray &block, int timeout);
+
+		/* read the chunks written by a CollectVisitor up to the end marker and
+		 * visit their items as they arrive; Unavailable if no chunk arrived */
+		static FetchResult visitItems(int fd, ItemVisitor &visitor, int timeout);
+		/* visit the items of a single chunk, last is set for the end marker */
+		static FetchResult visitChunk(const QByteArray &chunk, ItemVisitor &visitor, bool &last);
+};
+
+/* Serializes the visited items into item chunks, see SyncHelper */
+class CollectVisitor : public ItemVisitor
+{
+	public:
+		/* write every chunk to fd as soon as it is full */
+		CollectVisitor(int fd);
+		/* keep the chunks, e.g. to send them again later */
+		CollectVisitor(QValueList<QByteArray> &chunks);
+
+		virtual bool item(const QString &uid, const char *data, unsigned int size, const QString &hash);
+		virtual bool unchanged(const QString &uid);
+
+		/* pass on the last chunk and the end marker, call when done */
+		bool finish();
+
+	private:
+		void startChunk();
+		bool flush();
+
+		int fd;
+		QValueList<QByteArray> *chunks;
+		QBuffer buffer;
+		QDataStream stream;
+		Q_UINT32 count;
+		bool failed;
+};
+
+#endif // KDEPIM_OSYNC_SYNCHELPER_H
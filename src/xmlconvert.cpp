@@ -0,0 +1,374 @@
+/**
+ * Addressees and incidences as OpenSync xmlformat
+ */
+
+#include <kurl.h>
+#include <kabc/picture.h>
+#include <kabc/sound.h>
+#include <kabc/agent.h>
+#include <libkcal/event.h>
+#include <libkcal/todo.h>
+
+#include "xmlconvert.h"
+
+/** how the type bits of a phone number or address map to attributes */
+struct TypeAttribute
+{
+	int type;
+	const char *name;
+	const char *value;
+};
+
+static const TypeAttribute PHONE_TYPES[] = {
+	{ KABC::PhoneNumber::Home, "Location", "Home" },
+	{ KABC::PhoneNumber::Work, "Location", "Work" },
+	{ KABC::PhoneNumber::Pref, "Preferred", "true" },
+	{ KABC::PhoneNumber::Voice, "Type", "Voice" },
+	{ KABC::PhoneNumber::Fax, "Type", "Fax" },
+	{ KABC::PhoneNumber::Cell, "Type", "Cellular" },
+	{ KABC::PhoneNumber::Video, "Type", "Video" },
+	{ KABC::PhoneNumber::Bbs, "Type", "BBS" },
+	{ KABC::PhoneNumber::Modem, "Type", "Modem" },
+	{ KABC::PhoneNumber::Car, "Type", "Car" },
+	{ KABC::PhoneNumber::Isdn, "Type", "ISDN" },
+	{ KABC::PhoneNumber::Pcs, "Type", "PCS" },
+	{ KABC::PhoneNumber::Pager, "Type", "Pager" },
+	{ KABC::PhoneNumber::Msg, "Type", "Message" },
+	{ 0, 0, 0 }
+};
+
+static const TypeAttribute ADDRESS_TYPES[] = {
+	{ KABC::Address::Home, "Location", "Home" },
+	{ KABC::Address::Work, "Location", "Work" },
+	{ KABC::Address::Pref, "Preferred", "true" },
+	{ KABC::Address::Dom, "Type", "Domestic" },
+	{ KABC::Address::Intl, "Type", "International" },
+	{ KABC::Address::Postal, "Type", "Postal" },
+	{ KABC::Address::Parcel, "Type", "Parcel" },
+	{ 0, 0, 0 }
+};
+
+//--------------------------------------------------------------------------------
+
+/** Set the attributes for the type bits on field; without a field, only check
+ * that each bit has an attribute and no attribute is needed twice.
+ */
+static bool set_type_attributes(OSyncXMLField *field, int type, const TypeAttribute *attributes)
+{
+	QStringList used;
+	for (const TypeAttribute *a = attributes; a->name; a++) {
+		if (!(type & a->type))
+			continue;
+		if (used.contains(a->name))
+			return false;
+		used.append(a->name);
+		type &= ~a->type;
+		if (field)
+			osync_xmlfield_set_attr(field, a->name, a->value);
+	}
+	return type == 0;
+}
+
+//--------------------------------------------------------------------------------
+
+/** Everything but the product id, which names the application that wrote the
+ * card and is not content, must map to a field.
+ */
+bool XMLConvert::covers(const KABC::Addressee &e)
+{
+	if (!(e.photo() == KABC::Picture()) || !(e.logo() == KABC::Picture()) || !(e.sound() == KABC::Sound()))
+		return false;
+	if (!(e.agent() == KABC::Agent()) || !e.keys().isEmpty() || e.geo().isValid() || e.timeZone().isValid())
+		return false;
+	if (!e.customs().isEmpty() || !e.name().isEmpty() || !e.sortString().isEmpty())
+		return false;
+
+	KABC::PhoneNumber::List numbers = e.phoneNumbers();
+	for (KABC::PhoneNumber::List::ConstIterator it = numbers.begin(); it != numbers.end(); ++it)
+		if (!set_type_attributes(0, (*it).type(), PHONE_TYPES))
+			return false;
+
+	KABC::Address::List addresses = e.addresses();
+	for (KABC::Address::List::ConstIterator it = addresses.begin(); it != addresses.end(); ++it)
+		if (!(*it).label().isEmpty() || !set_type_attributes(0, (*it).type(), ADDRESS_TYPES))
+			return false;
+
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool XMLConvert::covers(const KCal::Incidence *e)
+{
+	if (e->doesRecur() || e->hasDuration() || !e->alarms().isEmpty() || !e->attachments().isEmpty())
+		return false;
+	if (!e->attendees().isEmpty() || !e->organizer().isEmpty() || !e->relatedToUid().isEmpty())
+		return false;
+	if (!e->resources().isEmpty() || !e->comments().isEmpty() || !e->customProperties().isEmpty())
+		return false;
+	return e->status() != KCal::Incidence::StatusX;
+}
+
+//--------------------------------------------------------------------------------
+
+bool XMLConvert::addField(OSyncXMLFormat *xmlformat, const char *name, const QString &value, OSyncError **error)
+{
+	if (value.isEmpty())
+		return true;
+
+	OSyncXMLField *field = osync_xmlfield_new(xmlformat, name, error);
+	return field && osync_xmlfield_set_key_value(field, "Content", value.utf8(), error);
+}
+
+//--------------------------------------------------------------------------------
+
+bool XMLConvert::addCategories(OSyncXMLFormat *xmlformat, const QStringList &categories, OSyncError **error)
+{
+	if (categories.isEmpty())
+		return true;
+
+	OSyncXMLField *field = osync_xmlfield_new(xmlformat, "Categories", error);
+	if (!field)
+		return false;
+	for (QStringList::ConstIterator it = categories.begin(); it != categories.end(); ++it)
+		if (!osync_xmlfield_add_key_value(field, "Category", (*it).utf8(), error))
+			return false;
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+/** A date and time in the basic iCalendar form, in UTC; a floating one as a date */
+bool XMLConvert::addDate(OSyncXMLFormat *xmlformat, const char *name, const QDateTime &stamp, bool floating, OSyncError **error)
+{
+	if (!stamp.isValid())
+		return true;
+
+	QString content = stamp.date().toString("yyyyMMdd");
+	if (!floating)
+		content += 'T' + stamp.time().toString("hhmmss") + 'Z';
+
+	OSyncXMLField *field = osync_xmlfield_new(xmlformat, name, error);
+	if (!field || !osync_xmlfield_set_key_value(field, "Content", content.utf8(), error))
+		return false;
+	if (floating)
+		osync_xmlfield_set_attr(field, "Value", "DATE");
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool XMLConvert::addName(OSyncXMLFormat *xmlformat, const KABC::Addressee &e, OSyncError **error)
+{
+	if (e.familyName().isEmpty() && e.givenName().isEmpty() && e.additionalName().isEmpty() &&
+	    e.prefix().isEmpty() && e.suffix().isEmpty())
+		return true;
+
+	// in the order of the vcard N property
+	OSyncXMLField *field = osync_xmlfield_new(xmlformat, "Name", error);
+	return field &&
+	       osync_xmlfield_set_key_value(field, "LastName", e.familyName().utf8(), error) &&
+	       osync_xmlfield_set_key_value(field, "FirstName", e.givenName().utf8(), error) &&
+	       osync_xmlfield_set_key_value(field, "Additional", e.additionalName().utf8(), error) &&
+	       osync_xmlfield_set_key_value(field, "Prefix", e.prefix().utf8(), error) &&
+	       osync_xmlfield_set_key_value(field, "Suffix", e.suffix().utf8(), error);
+}
+
+//--------------------------------------------------------------------------------
+
+bool XMLConvert::addOrganization(OSyncXMLFormat *xmlformat, const KABC::Addressee &e, OSyncError **error)
+{
+	if (e.organization().isEmpty() && e.department().isEmpty())
+		return true;
+
+	OSyncXMLField *field = osync_xmlfield_new(xmlformat, "Organization", error);
+	return field &&
+	       osync_xmlfield_set_key_value(field, "Name", e.organization().utf8(), error) &&
+	       osync_xmlfield_set_key_value(field, "Department", e.department().utf8(), error);
+}
+
+//--------------------------------------------------------------------------------
+
+bool XMLConvert::addTelephone(OSyncXMLFormat *xmlformat, const KABC::PhoneNumber &number, OSyncError **error)
+{
+	OSyncXMLField *field = osync_xmlfield_new(xmlformat, "Telephone", error);
+	if (!field || !osync_xmlfield_set_key_value(field, "Content", number.number().utf8(), error))
+		return false;
+	set_type_attributes(field, number.type(), PHONE_TYPES);
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+bool XMLConvert::addAddress(OSyncXMLFormat *xmlformat, const KABC::Address &address, OSyncError **error)
+{
+	// in the order of the vcard ADR property
+	OSyncXMLField *field = osync_xmlfield_new(xmlformat, "Address", error);
+	if (!field ||
+	    !osync_xmlfield_set_key_value(field, "PostalBox", address.postOfficeBox().utf8(), error) ||
+	    !osync_xmlfield_set_key_value(field, "ExtendedAddress", address.extended().utf8(), error) ||
+	    !osync_xmlfield_set_key_value(field, "Street", address.street().utf8(), error) ||
+	    !osync_xmlfield_set_key_value(field, "Locality", address.locality().utf8(), error) ||
+	    !osync_xmlfield_set_key_value(field, "Region", address.region().utf8(), error) ||
+	    !osync_xmlfield_set_key_value(field, "PostalCode", address.postalCode().utf8(), error) ||
+	    !osync_xmlfield_set_key_value(field, "Country", address.country().utf8(), error))
+		return false;
+	set_type_attributes(field, address.type(), ADDRESS_TYPES);
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+
+static QString secrecy_name(int type)
+{
+	switch (type) {
+		case KABC::Secrecy::Public: return "PUBLIC";
+		case KABC::Secrecy::Private: return "PRIVATE";
+		case KABC::Secrecy::Confidential: return "CONFIDENTIAL";
+		default: return QString::null;
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+OSyncXMLFormat *XMLConvert::fromAddressee(const char *objtype, const KABC::Addressee &e, OSyncError **error)
+{
+	OSyncXMLFormat *xmlformat = osync_xmlformat_new(objtype, error);
+	if (!xmlformat)
+		return 0;
+
+	bool ok = addField(xmlformat, "Uid", e.uid(), error) &&
+	          addField(xmlformat, "FormattedName", e.formattedName(), error) &&
+	          addName(xmlformat, e, error) &&
+	          addField(xmlformat, "Nickname", e.nickName(), error) &&
+	          addOrganization(xmlformat, e, error) &&
+	          addField(xmlformat, "Title", e.title(), error) &&
+	          addField(xmlformat, "Role", e.role(), error) &&
+	          addField(xmlformat, "Note", e.note(), error) &&
+	          addField(xmlformat, "Mailer", e.mailer(), error) &&
+	          addField(xmlformat, "Url", e.url().url(), error) &&
+	          addField(xmlformat, "Class", secrecy_name(e.secrecy().type()), error) &&
+	          addCategories(xmlformat, e.categories(), error);
+
+	// as VCardConverter writes them
+	QDateTime birthday = e.birthday();
+	if (ok && birthday.isValid())
+		ok = addField(xmlformat, "Birthday", birthday.time() == QTime(0, 0) ?
+		              birthday.date().toString(Qt::ISODate) : birthday.toString(Qt::ISODate), error);
+	if (ok && e.revision().isValid())
+		ok = addField(xmlformat, "Revision", e.revision().toString(Qt::ISODate) + 'Z', error);
+
+	QStringList emails = e.emails();
+	for (QStringList::ConstIterator it = emails.begin(); ok && it != emails.end(); ++it)
+		ok = addField(xmlformat, "EMail", *it, error);
+
+	KABC::PhoneNumber::List numbers = e.phoneNumbers();
+	for (KABC::PhoneNumber::List::ConstIterator it = numbers.begin(); ok && it != numbers.end(); ++it)
+		ok = addTelephone(xmlformat, *it, error);
+
+	KABC::Address::List addresses = e.addresses();
+	for (KABC::Address::List::ConstIterator it = addresses.begin(); ok && it != addresses.end(); ++it)
+		ok = addAddress(xmlformat, *it, error);
+
+	if (!ok) {
+		osync_xmlformat_unref(xmlformat);
+		return 0;
+	}
+	return xmlformat;
+}
+
+//--------------------------------------------------------------------------------
+
+static QString secrecy_name(const KCal::Incidence *e)
+{
+	switch (e->secrecy()) {
+		case KCal::Incidence::SecrecyPublic: return "PUBLIC";
+		case KCal::Incidence::SecrecyPrivate: return "PRIVATE";
+		case KCal::Incidence::SecrecyConfidential: return "CONFIDENTIAL";
+		default: return QString::null;
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+static QString status_name(const KCal::Incidence *e)
+{
+	switch (e->status()) {
+		case KCal::Incidence::StatusTentative: return "TENTATIVE";
+		case KCal::Incidence::StatusConfirmed: return "CONFIRMED";
+		case KCal::Incidence::StatusCompleted: return "COMPLETED";
+		case KCal::Incidence::StatusNeedsAction: return "NEEDS-ACTION";
+		case KCal::Incidence::StatusCanceled: return "CANCELLED";
+		case KCal::Incidence::StatusInProcess: return "IN-PROCESS";
+		case KCal::Incidence::StatusDraft: return "DRAFT";
+		case KCal::Incidence::StatusFinal: return "FINAL";
+		default: return QString::null;
+	}
+}
+
+//--------------------------------------------------------------------------------
+
+OSyncXMLFormat *XMLConvert::fromIncidence(const char *objtype, const KCal::Incidence *e, OSyncError **error)
+{
+	OSyncXMLFormat *xmlformat = osync_xmlformat_new(objtype, error);
+	if (!xmlformat)
+		return 0;
+
+	bool floating = e->doesFloat();
+	bool ok = addField(xmlformat, "Uid", e->uid(), error) &&
+	          addField(xmlformat, "Summary", e->summary(), error) &&
+	          addField(xmlformat, "Description", e->description(), error) &&
+	          addField(xmlformat, "Location", e->location(), error) &&
+	          addField(xmlformat, "Class", secrecy_name(e), error) &&
+	          addField(xmlformat, "Status", status_name(e), error) &&
+	          addField(xmlformat, "Sequence", QString::number(e->revision()), error) &&
+	          addCategories(xmlformat, e->categories(), error) &&
+	          addDate(xmlformat, "Created", e->created(), false, error) &&
+	          addDate(xmlformat, "LastModified", e->lastModified(), false, error);
+	// 0 is undefined
+	if (ok && e->priority() > 0)
+		ok = addField(xmlformat, "Priority", QString::number(e->priority()), error);
+
+	if (ok && e->type() == "Event") {
+		const KCal::Event *event = static_cast<const KCal::Event *>(e);
+		ok = addDate(xmlformat, "DateStarted", event->dtStart(), floating, error) &&
+		     addField(xmlformat, "TimeTransparency", event->transparency() == KCal::Event::Transparent ?
+		              "TRANSPARENT" : "OPAQUE", error);
+		// the end of an all-day event is the day after, as in iCalendar
+		if (ok && event->hasEndDate())
+			ok = addDate(xmlformat, "DateEnd", floating ? event->dtEnd().addDays(1) : event->dtEnd(), floating, error);
+	}
+	else if (ok && e->type() == "Todo") {
+		const KCal::Todo *todo = static_cast<const KCal::Todo *>(e);
+		if (todo->hasStartDate())
+			ok = addDate(xmlformat, "DateStarted", todo->dtStart(), floating, error);
+		if (ok && todo->hasDueDate())
+			ok = addDate(xmlformat, "Due", todo->dtDue(), floating, error);
+		if (ok && todo->hasCompletedDate())
+			ok = addDate(xmlformat, "Completed", todo->completed(), false, error);
+		if (ok && todo->percentComplete() > 0)
+			ok = addField(xmlformat, "PercentComplete", QString::number(todo->percentComplete()), error);
+	}
+
+	if (!ok) {
+		osync_xmlformat_unref(xmlformat);
+		return 0;
+	}
+	return xmlformat;
+}
+
+//--------------------------------------------------------------------------------
+
+OSyncData *XMLConvert::toData(OSyncXMLFormat *xmlformat, OSyncObjFormat *objformat, OSyncError **error)
+{
+	// the fields are added in no particular order, the schema has one
+	if (!osync_xmlformat_sort(xmlformat, error)) {
+		osync_xmlformat_unref(xmlformat);
+		return 0;
+	}
+
+	OSyncData *odata = osync_data_new(reinterpret_cast<char *>(xmlformat), osync_xmlformat_size(), objformat, error);
+	if (!odata)
+		osync_xmlformat_unref(xmlformat);
+	return odata;
+}
@@ -0,0 +1,50 @@
+#ifndef KDEPIM_OSYNC_XMLCONVERT_H
+#define KDEPIM_OSYNC_XMLCONVERT_H
+
+#include <qstring.h>
+#include <qstringlist.h>
+#include <qdatetime.h>
+#include <kabc/addressee.h>
+#include <libkcal/incidence.h>
+#include <opensync/opensync.h>
+#include <opensync/opensync-data.h>
+#include <opensync/opensync-format.h>
+#include <opensync/opensync-xmlformat.h>
+
+/* Builds the xmlformat of an addressee or incidence, so that the framework
+ * gets its fields without parsing a vcard or iCalendar text into them again.
+ *
+ * Only the plain fields are mapped. Items with anything else, e.g. a photo,
+ * a recurrence or alarms, are left to the framework's own mapping of the text
+ * format, see covers(). Received xmlformat is converted to text by the
+ * framework, see OSyncDataSource::convert_received().
+ */
+class XMLConvert
+{
+	public:
+		/* true if every field of the item has a counterpart here */
+		static bool covers(const KABC::Addressee &e);
+		static bool covers(const KCal::Incidence *e);
+
+		/* the xmlformat of objtype with the fields of the item, or 0 with error set;
+		 * the times of the incidence are taken as UTC or floating */
+		static OSyncXMLFormat *fromAddressee(const char *objtype, const KABC::Addressee &e, OSyncError **error);
+		static OSyncXMLFormat *fromIncidence(const char *objtype, const KCal::Incidence *e, OSyncError **error);
+
+		/* sort the fields and wrap them into data of objformat; xmlformat is
+		 * taken over, also on failure */
+		static OSyncData *toData(OSyncXMLFormat *xmlformat, OSyncObjFormat *objformat, OSyncError **error);
+
+		/* a field with value as its Content, nothing if value is empty */
+		static bool addField(OSyncXMLFormat *xmlformat, const char *name, const QString &value, OSyncError **error);
+
+	private:
+		static bool addCategories(OSyncXMLFormat *xmlformat, const QStringList &categories, OSyncError **error);
+		static bool addDate(OSyncXMLFormat *xmlformat, const char *name, const QDateTime &stamp, bool floating, OSyncError **error);
+		static bool addName(OSyncXMLFormat *xmlformat, const KABC::Addressee &e, OSyncError **error);
+		static bool addOrganization(OSyncXMLFormat *xmlformat, const KABC::Addressee &e, OSyncError **error);
+		static bool addTelephone(OSyncXMLFormat *xmlformat, const KABC::PhoneNumber &number, OSyncError **error);
+		static bool addAddress(OSyncXMLFormat *xmlformat, const KABC::Address &address, OSyncError **error);
+};
+
+#endif // KDEPIM_OSYNC_XMLCONVERT_H
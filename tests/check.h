@@ -0,0 +1,19 @@
+#ifndef KDEPIM_OSYNC_CHECK_H
+#define KDEPIM_OSYNC_CHECK_H
+
+#include <stdio.h>
+
+/* minimal assertions for the focused tests; main() returns CHECK_RESULT */
+static int check_failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			check_failures++; \
+		} \
+	} while (0)
+
+#define CHECK_RESULT (check_failures ? 1 : 0)
+
+#endif // KDEPIM_OSYNC_CHECK_H
@@ -0,0 +1,177 @@
+/**
+ * Tests of ChangeJournal, which files count as unchanged since the last sync
+ */
+
+#include <qfile.h>
+#include <qdir.h>
+
+#include "changejournal.h"
+#include "check.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Later than the stamps of files written now, even with the clock slack */
+static Q_INT64 after_writing()
+{
+	return ChangeJournal::now() + Q_INT64(3) * 1000000000;
+}
+
+static void write_file(const QString &path, const char *content)
+{
+	QFile file(path);
+	CHECK(file.open(IO_WriteOnly | IO_Truncate));
+	file.writeBlock(content, strlen(content));
+	file.close();
+}
+
+static void check_unchanged(const QString &dir)
+{
+	QString a = dir + "/a.vcf", b = dir + "/b.vcf", moved = dir + "/moved";
+	write_file(a, "one");
+	write_file(b, "two");
+
+	ChangeJournal journal;
+	CHECK(!journal.unchanged(a));
+
+	journal.begin(after_writing());
+	journal.record(a, QStringList() << "u1" << "u2");
+	journal.record(b);
+	CHECK(journal.isValid());
+	CHECK(journal.unchanged(a));
+	CHECK(journal.unchanged(b));
+	CHECK(!journal.unchanged(dir + "/unknown"));
+	CHECK(journal.allUnchanged());
+	CHECK(journal.uids(a) == (QStringList() << "u1" << "u2"));
+	CHECK(journal.uids(b).isEmpty());
+
+	// another size
+	write_file(b, "three");
+	CHECK(!journal.unchanged(b));
+	CHECK(journal.unchanged(a));
+	CHECK(!journal.allUnchanged());
+
+	// the same content in another file, which takes the place of the old one
+	write_file(moved, "one");
+	CHECK(::rename(QFile::encodeName(moved), QFile::encodeName(a)) == 0);
+	CHECK(!journal.unchanged(a));
+
+	// a file which is gone
+	QFile::remove(a);
+	CHECK(!journal.unchanged(a));
+
+	// an empty journal has nothing to compare
+	journal.begin(after_writing());
+	CHECK(!journal.allUnchanged());
+
+	journal.clear();
+	CHECK(!journal.isValid());
+	CHECK(!journal.unchanged(b));
+	QFile::remove(b);
+}
+
+static void check_touched(const QString &dir)
+{
+	QString a = dir + "/touched";
+	write_file(a, "one");
+
+	// written after the data was loaded, it might hold changes not reported
+	ChangeJournal journal;
+	journal.begin(ChangeJournal::now());
+	journal.record(a);
+	CHECK(!journal.isValid());
+	CHECK(!journal.unchanged(a));
+
+	// nothing is recorded into an invalid journal
+	journal.record(a);
+	CHECK(!journal.isValid());
+
+	journal.begin(after_writing());
+	journal.record(a);
+	journal.invalidate();
+	CHECK(!journal.unchanged(a));
+	QFile::remove(a);
+}
+
+static void check_paths(const QString &dir)
+{
+	QString sub = dir + "/resource";
+	CHECK(QDir().mkdir(sub));
+	write_file(sub + "/a.vcf", "one");
+	write_file(sub + "/.hidden", "two");
+
+	ChangeJournal journal;
+	journal.begin(after_writing());
+	journal.recordPaths(QStringList() << sub);
+	CHECK(journal.unchanged(sub));
+	CHECK(journal.unchanged(sub + "/a.vcf"));
+	CHECK(journal.unchanged(sub + "/.hidden"));
+
+	// a new file changes the directory
+	write_file(sub + "/b.vcf", "three");
+	CHECK(!journal.unchanged(sub));
+	CHECK(journal.unchanged(sub + "/a.vcf"));
+
+	QFile::remove(sub + "/a.vcf");
+	QFile::remove(sub + "/b.vcf");
+	QFile::remove(sub + "/.hidden");
+	QDir().rmdir(sub);
+}
+
+static void check_save_load(const QString &dir)
+{
+	QString a = dir + "/a.ics", path = dir + "/journal";
+	write_file(a, "one");
+
+	ChangeJournal journal;
+	CHECK(!journal.save(path));
+
+	journal.begin(after_writing());
+	journal.record(a, QStringList() << "u1");
+	journal.addUid("u2");
+	CHECK(journal.save(path));
+	CHECK(!QFile::exists(path + ".new"));
+
+	ChangeJournal loaded;
+	CHECK(loaded.load(path));
+	CHECK(loaded.isValid());
+	CHECK(loaded.unchanged(a));
+	CHECK(loaded.uids(a) == QStringList("u1"));
+	CHECK(loaded.allUids().count() == 2);
+	CHECK(loaded.allUids().contains("u1") && loaded.allUids().contains("u2"));
+
+	write_file(a, "longer");
+	CHECK(!loaded.unchanged(a));
+
+	// a journal which is cut off after its header, or not a journal at all
+	CHECK(::truncate(QFile::encodeName(path), 12) == 0);
+	CHECK(!loaded.load(path));
+	CHECK(!loaded.isValid());
+
+	write_file(path, "not a journal");
+	CHECK(!loaded.load(path));
+	CHECK(!loaded.load(dir + "/missing"));
+
+	QFile::remove(path);
+	QFile::remove(a);
+}
+
+int main()
+{
+	char tmpl[] = "/tmp/check_changejournal.XXXXXX";
+	if (!mkdtemp(tmpl)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	QString dir = QFile::decodeName(tmpl);
+
+	check_unchanged(dir);
+	check_touched(dir);
+	check_paths(dir);
+	check_save_load(dir);
+
+	QDir().rmdir(dir);
+	return CHECK_RESULT;
+}
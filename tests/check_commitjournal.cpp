@@ -0,0 +1,161 @@
+/**
+ * Tests of CommitJournal::load(), the records of an interrupted sync
+ */
+
+#include <qfile.h>
+#include <qdir.h>
+#include <qdatastream.h>
+
+#include "commitjournal.h"
+#include "check.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+/** A record as CommitJournal::append() writes it */
+static QByteArray record(OSyncChangeType type, const char *uid, const char *format, const char *data, unsigned int size)
+{
+	QByteArray record;
+	QDataStream out(record, IO_WriteOnly);
+	out << (Q_UINT32) 0;
+	out << (Q_INT32) type << QCString(uid) << QCString(format);
+	out.writeBytes(data, size);
+
+	Q_UINT32 length = htonl(record.size() - sizeof(Q_UINT32));
+	memcpy(record.data(), &length, sizeof(length));
+	return record;
+}
+
+static void write_file(const QString &path, const QByteArray &content, unsigned int size)
+{
+	QFile file(path);
+	CHECK(file.open(IO_WriteOnly | IO_Truncate));
+	file.writeBlock(content.data(), size);
+	file.close();
+}
+
+static QByteArray concat(const QByteArray &a, const QByteArray &b)
+{
+	QByteArray all(a.size() + b.size());
+	memcpy(all.data(), a.data(), a.size());
+	memcpy(all.data() + a.size(), b.data(), b.size());
+	return all;
+}
+
+static bool is_record(const CommitJournal::Record &r, OSyncChangeType type, const char *uid, const char *format,
+                      const char *data, unsigned int size)
+{
+	return r.type == type && r.uid == uid && r.format == format &&
+	       r.data.size() == size && (size == 0 || memcmp(r.data.data(), data, size) == 0);
+}
+
+static void check_missing(const QString &dir)
+{
+	CommitJournal journal;
+	QValueList<CommitJournal::Record> records;
+	CHECK(!journal.load(records));
+
+	journal.setPath(dir + "/missing");
+	CHECK(!journal.load(records));
+	CHECK(records.isEmpty());
+}
+
+static void check_truncated(const QString &dir)
+{
+	// the data of a record may hold any byte
+	const char vcard[] = "BEGIN:VCARD\r\nUID:a\r\nEND:VCARD\r\n";
+	const char binary[] = { 'x', 0, '\n', 'y' };
+
+	QByteArray first = record(OSYNC_CHANGE_TYPE_ADDED, "a", "vcard30", vcard, strlen(vcard));
+	QByteArray second = record(OSYNC_CHANGE_TYPE_MODIFIED, "b", "plain", binary, sizeof(binary));
+	QByteArray third = record(OSYNC_CHANGE_TYPE_DELETED, "c", "", 0, 0);
+	QByteArray complete = concat(first, second);
+	QByteArray all = concat(complete, third);
+
+	QString path = dir + "/journal";
+	CommitJournal journal;
+	journal.setPath(path);
+	QValueList<CommitJournal::Record> records;
+
+	write_file(path, all, 0);
+	CHECK(journal.load(records));
+	CHECK(records.isEmpty());
+
+	write_file(path, all, all.size());
+	CHECK(journal.load(records));
+	CHECK(records.count() == 3);
+	if (records.count() == 3) {
+		CHECK(is_record(records[0], OSYNC_CHANGE_TYPE_ADDED, "a", "vcard30", vcard, strlen(vcard)));
+		CHECK(is_record(records[1], OSYNC_CHANGE_TYPE_MODIFIED, "b", "plain", binary, sizeof(binary)));
+		CHECK(is_record(records[2], OSYNC_CHANGE_TYPE_DELETED, "c", "", 0, 0));
+	}
+
+	// cut at every byte of the last record: in its length, right after it,
+	// and in its payload; the complete records before it are kept
+	for (unsigned int size = complete.size(); size < all.size(); size++) {
+		write_file(path, all, size);
+		CHECK(journal.load(records));
+		CHECK(records.count() == 2);
+		if (records.count() == 2)
+			CHECK(is_record(records[1], OSYNC_CHANGE_TYPE_MODIFIED, "b", "plain", binary, sizeof(binary)));
+	}
+
+	// a length beyond the end of the file, e.g. from a torn write
+	QByteArray bogus = third.copy();
+	Q_UINT32 length = htonl(0x7fffffff);
+	memcpy(bogus.data(), &length, sizeof(length));
+	QByteArray broken = concat(first, bogus);
+	write_file(path, broken, broken.size());
+	CHECK(journal.load(records));
+	CHECK(records.count() == 1);
+
+	QFile::remove(path);
+}
+
+static void check_append(const QString &dir)
+{
+	OSyncError *error = NULL;
+	OSyncChange *chg = osync_change_new(&error);
+	CHECK(chg != 0);
+	if (!chg) {
+		osync_error_unref(&error);
+		return;
+	}
+	osync_change_set_uid(chg, "gone");
+	osync_change_set_changetype(chg, OSYNC_CHANGE_TYPE_DELETED);
+
+	CommitJournal journal;
+	journal.setPath(dir + "/appended");
+	CHECK(journal.append(chg));
+	CHECK(journal.append(chg));
+	CHECK(journal.sync());
+	osync_change_unref(chg);
+
+	QValueList<CommitJournal::Record> records;
+	CHECK(journal.load(records));
+	CHECK(records.count() == 2);
+	if (records.count() == 2)
+		CHECK(is_record(records[1], OSYNC_CHANGE_TYPE_DELETED, "gone", "", 0, 0));
+
+	journal.discard();
+	CHECK(!journal.load(records));
+}
+
+int main()
+{
+	char tmpl[] = "/tmp/check_commitjournal.XXXXXX";
+	if (!mkdtemp(tmpl)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	QString dir = QFile::decodeName(tmpl);
+
+	check_missing(dir);
+	check_truncated(dir);
+	check_append(dir);
+
+	QDir().rmdir(dir);
+	return CHECK_RESULT;
+}
@@ -0,0 +1,77 @@
+/**
+ * Tests of EchoTable, reading and writing its table in the state database
+ */
+
+#include <qcstring.h>
+#include <qstring.h>
+
+#include "echotable.h"
+#include "check.h"
+
+static const char FP1[] = "0123456789abcdef";
+static const char FP2[] = "fedcba9876543210";
+
+static void check_parse()
+{
+	EchoTable echoes;
+	CHECK(!echoes.isLoaded());
+
+	echoes.parse("");
+	CHECK(echoes.isLoaded());
+	CHECK(!echoes.contains("uid"));
+
+	// the last line needs no line break
+	echoes.parse(QCString(FP1) + "uid-1\n" + FP2 + "uid with spaces");
+	CHECK(echoes.contains("uid-1"));
+	CHECK(echoes.contains("uid with spaces"));
+	CHECK(!echoes.isChanged());
+
+	// an entry is used up by the check, whatever its outcome
+	CHECK(echoes.isEcho("uid-1", FP1));
+	CHECK(!echoes.contains("uid-1"));
+	CHECK(!echoes.isEcho("uid-1", FP1));
+	CHECK(!echoes.isEcho("uid with spaces", FP1));
+	CHECK(!echoes.contains("uid with spaces"));
+	CHECK(echoes.isChanged());
+
+	// lines without a uid are skipped, a parse starts over
+	echoes.parse(QCString("short\n") + FP1 + "\n\n" + FP2 + "x\n");
+	CHECK(!echoes.isChanged());
+	CHECK(!echoes.contains("short"));
+	CHECK(!echoes.contains(""));
+	CHECK(!echoes.contains("uid with spaces"));
+	CHECK(echoes.isEcho("x", FP2));
+}
+
+static void check_round_trip()
+{
+	EchoTable echoes;
+	echoes.parse("");
+	echoes.record("a", FP1);
+	echoes.record("b", FP2);
+	echoes.record("a", FP2);  // the last commit counts
+	// such uids could not be read back
+	echoes.record("", FP1);
+	echoes.record("two\nlines", FP1);
+	CHECK(echoes.isChanged());
+
+	EchoTable loaded;
+	loaded.parse(echoes.table());
+	CHECK(loaded.contains("a"));
+	CHECK(loaded.contains("b"));
+	CHECK(!loaded.contains(""));
+	CHECK(!loaded.contains("two"));
+	CHECK(!loaded.contains("lines"));
+	CHECK(loaded.isEcho("a", FP2));
+	CHECK(loaded.isEcho("b", FP2) == false);
+
+	// nothing left to write
+	CHECK(loaded.table().isEmpty());
+}
+
+int main()
+{
+	check_parse();
+	check_round_trip();
+	return CHECK_RESULT;
+}
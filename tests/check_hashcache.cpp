@@ -0,0 +1,138 @@
+/**
+ * Tests of HashCache, the in-memory snapshot of a sink's hashtable
+ */
+
+#include <qcstring.h>
+#include <qvaluelist.h>
+
+#include "hashcache.h"
+#include "check.h"
+
+#include <string.h>
+
+/** FNV-1a as HashCache uses it, to pick uids which collide in a small table */
+static Q_UINT32 code_of(const char *uid)
+{
+	Q_UINT32 code = 2166136261U;
+	for (; *uid; uid++) {
+		code ^= (unsigned char) *uid;
+		code *= 16777619U;
+	}
+	return code;
+}
+
+static bool has_hash(const HashCache &cache, const char *uid, const char *hash)
+{
+	const char *found = cache.find(uid);
+	return found && strcmp(found, hash) == 0;
+}
+
+/** uids which all start their probe in the last slot of a table of 16, so
+ * that their cluster wraps around to the first slots */
+static void colliding_uids(QValueList<QCString> &uids, unsigned int count)
+{
+	for (int i = 0; uids.count() < count; i++) {
+		QCString uid = "c" + QCString().setNum(i);
+		if ((code_of(uid) & 15) == 15)
+			uids.append(uid);
+	}
+}
+
+static void check_empty()
+{
+	HashCache cache;
+	CHECK(!cache.isLoaded());
+	CHECK(cache.count() == 0);
+	CHECK(cache.find("uid") == 0);
+	CHECK(cache.mark("uid") == 0);
+	CHECK(cache.unmarked().isEmpty());
+}
+
+static void check_probing()
+{
+	// seven entries stay in the first table of 16 slots
+	QValueList<QCString> uids;
+	colliding_uids(uids, 8);
+	QCString absent = uids.last();
+	uids.remove(uids.fromLast());
+
+	HashCache cache;
+	for (QValueList<QCString>::ConstIterator it = uids.begin(); it != uids.end(); ++it)
+		cache.insert(*it, "h" + *it);
+
+	CHECK(cache.count() == 7);
+	for (QValueList<QCString>::ConstIterator it = uids.begin(); it != uids.end(); ++it)
+		CHECK(has_hash(cache, *it, "h" + *it));
+	// the probe for an unknown uid with the same start ends behind the cluster
+	CHECK(cache.find(absent) == 0);
+
+	// a resize keeps them all
+	for (int i = 0; i < 20; i++)
+		cache.insert("other" + QCString().setNum(i), "x");
+	for (QValueList<QCString>::ConstIterator it = uids.begin(); it != uids.end(); ++it)
+		CHECK(has_hash(cache, *it, "h" + *it));
+	CHECK(cache.find(absent) == 0);
+}
+
+static void check_resize()
+{
+	// many resizes of the table and the string pool
+	const int count = 5000;
+	HashCache cache;
+	for (int i = 0; i < count; i++) {
+		QCString n = QCString().setNum(i);
+		cache.insert("uid-" + n, "hash-" + n);
+	}
+
+	CHECK(cache.count() == (unsigned int) count);
+	bool all = true;
+	for (int i = 0; i < count; i++) {
+		QCString n = QCString().setNum(i);
+		all = all && has_hash(cache, "uid-" + n, "hash-" + n);
+	}
+	CHECK(all);
+	CHECK(cache.find("uid-5000") == 0);
+	CHECK(cache.find("uid-") == 0);
+	CHECK(cache.find("") == 0);
+
+	// an entry without a hash is still known
+	cache.insert("nohash", "");
+	CHECK(has_hash(cache, "nohash", ""));
+
+	cache.clear();
+	CHECK(cache.count() == 0);
+	CHECK(cache.find("uid-1") == 0);
+}
+
+static void check_unmarked()
+{
+	HashCache cache;
+	for (int i = 0; i < 100; i++)
+		cache.insert("uid-" + QCString().setNum(i), "h");
+
+	// mark the even ones, some of them twice
+	for (int i = 0; i < 100; i += 2)
+		CHECK(cache.mark("uid-" + QCString().setNum(i)) != 0);
+	CHECK(cache.mark("uid-0") != 0);
+	CHECK(cache.mark("uid-100") == 0);
+
+	QValueList<QCString> unmarked = cache.unmarked();
+	CHECK(unmarked.count() == 50);
+	bool odd = true;
+	for (int i = 1; i < 100; i += 2)
+		odd = odd && unmarked.contains("uid-" + QCString().setNum(i));
+	CHECK(odd);
+
+	// find does not mark
+	cache.find("uid-1");
+	CHECK(cache.unmarked().count() == 50);
+}
+
+int main()
+{
+	check_empty();
+	check_probing();
+	check_resize();
+	check_unmarked();
+	return CHECK_RESULT;
+}
@@ -0,0 +1,52 @@
+/**
+ * Tests of OSyncDataSource::property_date(), the date a text property starts with
+ */
+
+#include <qdatetime.h>
+
+#include "datasource.h"
+#include "check.h"
+
+#include <string.h>
+
+static QDate date_of(const char *data, const char *name)
+{
+	return OSyncDataSource::property_date(data, strlen(data), name);
+}
+
+int main()
+{
+	// both the basic and the extended form
+	CHECK(date_of("BEGIN:VEVENT\r\nDTSTART:20080131T120000Z\r\nEND:VEVENT\r\n", "\nDTSTART") == QDate(2008, 1, 31));
+	CHECK(date_of("BEGIN:VCARD\r\nREV:2008-01-31T12:00:00Z\r\nEND:VCARD\r\n", "\nREV") == QDate(2008, 1, 31));
+
+	// parameters are skipped
+	CHECK(date_of("X\nDTSTART;VALUE=DATE:20080229\n", "\nDTSTART") == QDate(2008, 2, 29));
+	CHECK(date_of("X\nDUE;TZID=Europe/Berlin:20081231T235959\n", "\nDUE") == QDate(2008, 12, 31));
+
+	// only the property of that very name, at the start of a line
+	CHECK(date_of("X\nDTSTARTX:20070101\nDTSTART:20090101\n", "\nDTSTART") == QDate(2009, 1, 1));
+	CHECK(date_of("X\nX-DTSTART:20070101\n", "\nDTSTART").isNull());
+	CHECK(date_of("DTSTART:20070101\n", "\nDTSTART").isNull());
+	CHECK(date_of("X\nSUMMARY:DTSTART:20070101\n", "\nDTSTART").isNull());
+
+	// the first one counts
+	CHECK(date_of("X\nDUE:20080101\nDUE:20090101\n", "\nDUE") == QDate(2008, 1, 1));
+
+	// no usable date
+	CHECK(date_of("X\nSUMMARY:x\n", "\nDTSTART").isNull());
+	CHECK(date_of("X\nDTSTART:20080230\n", "\nDTSTART").isNull());
+	CHECK(date_of("X\nDTSTART:2008013\n", "\nDTSTART").isNull());
+	CHECK(date_of("X\nDTSTART:\n", "\nDTSTART").isNull());
+	CHECK(date_of("X\nDTSTART;VALUE=DATE\n:20080101\n", "\nDTSTART").isNull());
+	CHECK(date_of("X\nREV:2008/01/31\n", "\nREV").isNull());
+	CHECK(date_of("", "\nREV").isNull());
+
+	// the data need not end with a 0, nothing behind size is read
+	const char cut[] = "X\nDTSTART:20080131\n";
+	CHECK(OSyncDataSource::property_date(cut, strlen(cut) - 1, "\nDTSTART") == QDate(2008, 1, 31));
+	CHECK(OSyncDataSource::property_date(cut, strlen(cut) - 2, "\nDTSTART").isNull());
+	CHECK(OSyncDataSource::property_date(cut, 9, "\nDTSTART").isNull());
+
+	return CHECK_RESULT;
+}
@@ -0,0 +1,55 @@
+/**
+ * Tests of strip_html(), the plain text of the rich text body of a note
+ */
+
+#include <qstring.h>
+
+#include "richtext.h"
+#include "check.h"
+
+static bool strips(const char *input, const char *expected)
+{
+	QString output = strip_html(QString::fromUtf8(input));
+	if (output == QString::fromUtf8(expected))
+		return true;
+	fprintf(stderr, "strip_html(\"%s\") gave \"%s\"\n", input, (const char *) output.utf8());
+	return false;
+}
+
+int main()
+{
+	// plain text is only trimmed, entities stay as they are
+	CHECK(strips("  plain &amp; text \n", "plain &amp; text"));
+	CHECK(strips("", ""));
+
+	// a note as KNotes writes it
+	CHECK(strips("<html><head><meta name=\"qrichtext\" content=\"1\" /><title>x</title></head>"
+	             "<body style=\"font-size:10pt\"><p>Hello &amp; world</p><p>second</p></body></html>",
+	             "Hello & world\nsecond"));
+
+	// line breaks: <br> always, block tags once, raw ones are whitespace
+	CHECK(strips("<p>a<br>b<br><br>c</p>", "a\nb\n\nc"));
+	CHECK(strips("<div>one</div><div>two</div>", "one\ntwo"));
+	CHECK(strips("<p>raw\nline\tbreak</p>", "raw line break"));
+	CHECK(strips("<P>upper<BR>case</P>", "upper\ncase"));
+
+	// entities
+	CHECK(strips("<b>&lt;&gt;&quot;&apos;&nbsp;&#65;&#x42;</b>", "<>\"' AB"));
+	CHECK(strips("<b>&unknown; &#; &#xzz;</b>", "&unknown; &#; &#xzz;"));
+
+	// content which is not text
+	CHECK(strips("<style>p { color: red }</style><script>x < y</script>text", "text"));
+	CHECK(strips("a<!-- <p>comment</p> -->b", "ab"));
+
+	// runs longer than one vector of the fast path, with markup at every offset
+	QString run = "abcdefghijklmnopqrstuvwxyz0123456789";
+	for (unsigned int i = 0; i <= run.length(); i++) {
+		QString input = "<i>" + run.left(i) + "&amp;" + run.mid(i) + "</i>";
+		CHECK(strip_html(input) == run.left(i) + "&" + run.mid(i));
+	}
+
+	// an unterminated tag ends the text
+	CHECK(strips("text<b", "text"));
+
+	return CHECK_RESULT;
+}
@@ -0,0 +1,124 @@
+/**
+ * Tests of SyncBudget, which held back changes are reported and in which order
+ */
+
+#include <qvaluelist.h>
+
+#include "syncbudget.h"
+#include "check.h"
+
+#include <unistd.h>
+
+static SyncBudget::Item item(const char *uid, int rank)
+{
+	SyncBudget::Item item;
+	item.uid = uid;
+	item.hash = "h";
+	item.type = OSYNC_CHANGE_TYPE_ADDED;
+	item.objformat = 0;
+	item.rank = rank;
+	return item;
+}
+
+static void check_inactive()
+{
+	SyncBudget budget;
+	CHECK(!budget.isEnabled());
+	CHECK(!budget.begin(FALSE));
+	CHECK(!budget.isActive());
+
+	// the engine has to see every item of a slow-sync
+	budget.setup(5, 0);
+	CHECK(budget.isEnabled());
+	CHECK(!budget.begin(TRUE));
+	CHECK(!budget.isActive());
+	CHECK(budget.begin(FALSE));
+	CHECK(budget.isActive());
+}
+
+static void check_order()
+{
+	SyncBudget budget;
+	budget.setup(10, 0);
+	CHECK(budget.begin(FALSE));
+
+	const int ranks[] = { 5, 1, 3, 1, 2, 4 };
+	for (unsigned int i = 0; i < sizeof(ranks) / sizeof(ranks[0]); i++)
+		budget.hold(item("uid-" + QCString().setNum(i), ranks[i]));
+
+	QValueList<SyncBudget::Item> items = budget.take();
+	CHECK(items.count() == 6);
+	CHECK(!budget.isActive());
+
+	bool sorted = true;
+	int previous = 0;
+	for (QValueList<SyncBudget::Item>::ConstIterator it = items.begin(); it != items.end(); ++it) {
+		sorted = sorted && (*it).rank >= previous;
+		previous = (*it).rank;
+	}
+	CHECK(sorted);
+	CHECK(items.last().uid == "uid-0");
+
+	// they are handed out once
+	CHECK(budget.take().isEmpty());
+
+	// and a new sync starts without the ones of the last
+	CHECK(budget.begin(FALSE));
+	budget.hold(item("left", 1));
+	CHECK(budget.begin(FALSE));
+	CHECK(budget.take().isEmpty());
+}
+
+static void check_max_changes()
+{
+	SyncBudget budget;
+	budget.setup(3, 0);
+	CHECK(budget.begin(FALSE));
+	budget.take();
+
+	CHECK(budget.allows(0));
+	CHECK(budget.allows(2));
+	CHECK(!budget.allows(3));
+	CHECK(!budget.allows(100));
+
+	// modifications reported right away count as well
+	CHECK(budget.begin(FALSE));
+	budget.spend();
+	budget.spend();
+	budget.take();
+	CHECK(!budget.allows(1));
+
+	// but one held back change goes out in every sync
+	budget.spend();
+	CHECK(budget.allows(0));
+
+	// and a new sync starts with nothing spent
+	CHECK(budget.begin(FALSE));
+	budget.take();
+	CHECK(budget.allows(2));
+}
+
+static void check_seconds()
+{
+	SyncBudget budget;
+	budget.setup(0, 1);
+	CHECK(budget.begin(FALSE));
+
+	// loading and enumerating do not count
+	sleep(1);
+	budget.take();
+	CHECK(budget.allows(1000));
+
+	sleep(1);
+	CHECK(!budget.allows(1));
+	CHECK(budget.allows(0));
+}
+
+int main()
+{
+	check_inactive();
+	check_order();
+	check_max_changes();
+	check_seconds();
+	return CHECK_RESULT;
+}
@@ -0,0 +1,129 @@
+/**
+ * Tests of XMLConvert::covers(), which items go to the framework as xmlformat
+ */
+
+#include <qdatetime.h>
+#include <kurl.h>
+#include <kabc/addressee.h>
+#include <kabc/picture.h>
+#include <libkcal/event.h>
+#include <libkcal/todo.h>
+#include <libkcal/attendee.h>
+
+#include "xmlconvert.h"
+#include "check.h"
+
+static KABC::Addressee plain_addressee()
+{
+	KABC::Addressee e;
+	e.setFamilyName("Doe");
+	e.setGivenName("Jane");
+	e.setFormattedName("Jane Doe");
+	e.setOrganization("Example");
+	e.insertEmail("jane@example.org");
+	e.insertCategory("Friends");
+	e.setBirthday(QDateTime(QDate(1970, 1, 2)));
+	e.insertPhoneNumber(KABC::PhoneNumber("+1 555 0100", KABC::PhoneNumber::Home | KABC::PhoneNumber::Voice));
+	e.insertPhoneNumber(KABC::PhoneNumber("+1 555 0101", KABC::PhoneNumber::Work | KABC::PhoneNumber::Cell | KABC::PhoneNumber::Pref));
+
+	KABC::Address address(KABC::Address::Work | KABC::Address::Postal);
+	address.setStreet("Main Street 1");
+	address.setLocality("Springfield");
+	e.insertAddress(address);
+	return e;
+}
+
+static void check_addressee()
+{
+	CHECK(XMLConvert::covers(KABC::Addressee()));
+	CHECK(XMLConvert::covers(plain_addressee()));
+
+	// a number can't be at home and at work in one field
+	KABC::Addressee e = plain_addressee();
+	e.insertPhoneNumber(KABC::PhoneNumber("+1 555 0102", KABC::PhoneNumber::Home | KABC::PhoneNumber::Work));
+	CHECK(!XMLConvert::covers(e));
+
+	e = plain_addressee();
+	KABC::Address labeled(KABC::Address::Home);
+	labeled.setStreet("Elm Street 2");
+	labeled.setLabel("Jane Doe\nElm Street 2");
+	e.insertAddress(labeled);
+	CHECK(!XMLConvert::covers(e));
+
+	e = plain_addressee();
+	KABC::Picture photo;
+	photo.setUrl("http://example.org/jane.png");
+	e.setPhoto(photo);
+	CHECK(!XMLConvert::covers(e));
+
+	e = plain_addressee();
+	e.insertCustom("KADDRESSBOOK", "X-SpousesName", "John");
+	CHECK(!XMLConvert::covers(e));
+
+	e = plain_addressee();
+	e.setGeo(KABC::Geo(52.5, 13.4));
+	CHECK(!XMLConvert::covers(e));
+
+	e = plain_addressee();
+	e.setName("Jane");
+	CHECK(!XMLConvert::covers(e));
+}
+
+static KCal::Event *plain_event()
+{
+	KCal::Event *event = new KCal::Event();
+	event->setSummary("Meeting");
+	event->setLocation("Room 1");
+	event->setCategories("Work");
+	event->setDtStart(QDateTime(QDate(2008, 1, 31), QTime(12, 0)));
+	event->setDtEnd(QDateTime(QDate(2008, 1, 31), QTime(13, 0)));
+	return event;
+}
+
+static void check_incidence()
+{
+	KCal::Event *event = plain_event();
+	CHECK(XMLConvert::covers(event));
+	event->setFloats(true);
+	CHECK(XMLConvert::covers(event));
+	delete event;
+
+	event = plain_event();
+	event->recurrence()->setDaily(1);
+	CHECK(!XMLConvert::covers(event));
+	delete event;
+
+	event = plain_event();
+	event->newAlarm();
+	CHECK(!XMLConvert::covers(event));
+	delete event;
+
+	event = plain_event();
+	event->addAttendee(new KCal::Attendee("Jane Doe", "jane@example.org"));
+	CHECK(!XMLConvert::covers(event));
+	delete event;
+
+	event = plain_event();
+	event->setCustomProperty("KORGANIZER", "X-FOO", "bar");
+	CHECK(!XMLConvert::covers(event));
+	delete event;
+
+	KCal::Todo *todo = new KCal::Todo();
+	todo->setSummary("Call back");
+	todo->setDtDue(QDateTime(QDate(2008, 2, 1), QTime(9, 0)));
+	todo->setHasDueDate(true);
+	todo->setPercentComplete(50);
+	CHECK(XMLConvert::covers(todo));
+
+	// a status of its own has no counterpart
+	todo->setCustomStatus("X-WAITING");
+	CHECK(!XMLConvert::covers(todo));
+	delete todo;
+}
+
+int main()
+{
+	check_addressee();
+	check_incidence();
+	return CHECK_RESULT;
+}